@@ -1,10 +1,13 @@
 #include "Assembly.h"
+#include "Flow.h"
 
 #include <cstring>
 #include <string>
 #include <sstream>
 #include <iomanip>
 #include <memory>
+#include <functional>
+#include <algorithm>
 
 static std::pair<std::string, std::string> getSysCall(SysCall syscall, RuntimeValue rt) {
     std::string syscallname;
@@ -185,36 +188,349 @@ std::string AsmToken::toString() const {
     return s.str();
 }
 
-std::vector<AsmToken> optimise(const int cpu, const std::vector<AsmToken> &asmTokens) {
-    std::vector<AsmToken> output;
+static bool hasLabel(const AsmToken &token) {
+    return token.label.size() && OpCodeDefinition[OpCodeAsString(token.opcode)].second != ArgType::LABEL;
+}
+
+static bool sameArg(const AsmToken &a, const AsmToken &b) {
+    return a.arg == b.arg;
+}
+
+// True when the value in `reg' at `start' is overwritten before it is read on
+// the fall-through path. Anything that leaves the block keeps it live.
+bool isDead(const std::vector<AsmToken> &asmTokens, size_t start, Effect reg) {
+    for (size_t i = start; i < asmTokens.size(); i++) {
+        auto reads = OpCodeReads(asmTokens[i].opcode);
+        auto writes = OpCodeWrites(asmTokens[i].opcode);
+
+        if (reads & reg)
+            return false;
+
+        if (writes & reg)
+            return true;
+
+        if ((reads|writes) & EFFECT_CONTROL)
+            return false;
+    }
+
+    return false;
+}
+
+static OpCode retarget(OpCode opcode, OpCode move) {
+    static const std::map<OpCode, std::pair<OpCode, OpCode>> targets = {
+        {OpCode::SETC, {OpCode::SETA, OpCode::SETB}},
+        {OpCode::LOADC, {OpCode::LOADA, OpCode::LOADB}},
+        {OpCode::READC, {OpCode::READA, OpCode::READB}},
+    };
+
+    auto target = targets.at(opcode);
+
+    return move == OpCode::MOVCA || move == OpCode::POPA ? target.first : target.second;
+}
+
+static bool isDeadAt(const std::vector<AsmToken> &asmTokens, const std::string &label, Effect reg) {
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        if (hasLabel(asmTokens[i]) && asmTokens[i].label == label)
+            return isDead(asmTokens, i, reg);
+    }
+
+    return false;
+}
+
+// Conditional jumps and the jump taken on the opposite condition
+static OpCode invert(OpCode opcode) {
+    static const std::map<OpCode, OpCode> inverse = {
+        {OpCode::JMPEZ, OpCode::JMPNZ}, {OpCode::JMPNZ, OpCode::JMPEZ},
+        {OpCode::JMPEQ, OpCode::JMPNE}, {OpCode::JMPNE, OpCode::JMPEQ},
+        {OpCode::JMPLT, OpCode::JMPGE}, {OpCode::JMPGE, OpCode::JMPLT},
+        {OpCode::JMPLE, OpCode::JMPGT}, {OpCode::JMPGT, OpCode::JMPLE},
+    };
+
+    return inverse.at(opcode);
+}
+
+// The fused jump taken when `compare' gives a non-zero result
+static OpCode fuse(OpCode compare) {
+    static const std::map<OpCode, OpCode> fused = {
+        {OpCode::EQ, OpCode::JMPEQ}, {OpCode::NE, OpCode::JMPNE},
+        {OpCode::LT, OpCode::JMPLT}, {OpCode::LE, OpCode::JMPLE},
+        {OpCode::GT, OpCode::JMPGT}, {OpCode::GE, OpCode::JMPGE},
+    };
 
+    return fused.at(compare);
+}
+
+struct PeepholeRule {
+    const std::string name;
+    const std::vector<std::vector<OpCode>> pattern;
+    const std::function<bool(const std::vector<AsmToken> &, size_t)> guard;
+    const std::function<std::vector<AsmToken>(const std::vector<AsmToken> &, size_t)> rewrite;
+};
+
+static const std::vector<OpCode> LoadC = { OpCode::SETC, OpCode::LOADC, OpCode::READC };
+
+// Rules are tried in order at each instruction, so longer windows that
+// overlap a shorter rule come first. Every rewrite must leave the registers,
+// stack and memory as the original sequence did, except for registers the
+// guard has shown to be dead.
+static const std::vector<PeepholeRule> PeepholeRules = {
+    {
+        "load-push-pop",
+        { LoadC, { OpCode::PUSHC }, { OpCode::POPA, OpCode::POPB } },
+        [](const std::vector<AsmToken> &t, size_t i) { return isDead(t, i+3, EFFECT_C); },
+        [](const std::vector<AsmToken> &t, size_t i) {
+            auto token = t[i];
+            token.opcode = retarget(t[i].opcode, t[i+2].opcode);
+            return std::vector<AsmToken>{ token };
+        }
+    },
+    {
+        "push-pop-c",
+        { { OpCode::PUSHC }, { OpCode::POPC } },
+        nullptr,
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{}; }
+    },
+    {
+        "push-pop-a",
+        { { OpCode::PUSHC }, { OpCode::POPA } },
+        nullptr,
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{ AsmToken(OpCode::MOVCA) }; }
+    },
+    {
+        "push-pop-b",
+        { { OpCode::PUSHC }, { OpCode::POPB } },
+        nullptr,
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{ AsmToken(OpCode::MOVCB) }; }
+    },
+    {
+        "push-pop-idx",
+        { { OpCode::PUSHC }, { OpCode::POPIDX } },
+        nullptr,
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{ AsmToken(OpCode::MOVCIDX) }; }
+    },
+    {
+        "pushidx-popidx",
+        { { OpCode::PUSHIDX }, { OpCode::POPIDX } },
+        nullptr,
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{}; }
+    },
+    {
+        "load-move",
+        { LoadC, { OpCode::MOVCA, OpCode::MOVCB } },
+        [](const std::vector<AsmToken> &t, size_t i) { return isDead(t, i+2, EFFECT_C); },
+        [](const std::vector<AsmToken> &t, size_t i) {
+            auto token = t[i];
+            token.opcode = retarget(t[i].opcode, t[i+1].opcode);
+            return std::vector<AsmToken>{ token };
+        }
+    },
+    {
+        "store-load",
+        { { OpCode::STOREC }, { OpCode::LOADC } },
+        [](const std::vector<AsmToken> &t, size_t i) { return sameArg(t[i], t[i+1]); },
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{ t[i] }; }
+    },
+    {
+        "write-read",
+        { { OpCode::WRITEC }, { OpCode::READC } },
+        [](const std::vector<AsmToken> &t, size_t i) { return sameArg(t[i], t[i+1]); },
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{ t[i] }; }
+    },
+    {
+        "compare-branch",
+        { { OpCode::EQ, OpCode::NE, OpCode::LT, OpCode::LE, OpCode::GT, OpCode::GE }, { OpCode::JMPEZ, OpCode::JMPNZ } },
+        [](const std::vector<AsmToken> &t, size_t i) { return isDead(t, i+2, EFFECT_C) && isDeadAt(t, t[i+1].label, EFFECT_C); },
+        [](const std::vector<AsmToken> &t, size_t i) {
+            auto opcode = fuse(t[i].opcode);
+            auto token = AsmToken(t[i+1].opcode == OpCode::JMPNZ ? opcode : invert(opcode));
+            token.label = t[i+1].label;
+            return std::vector<AsmToken>{ token };
+        }
+    },
+    {
+        "not-branch",
+        { { OpCode::NOT }, { OpCode::JMPEZ, OpCode::JMPNZ } },
+        [](const std::vector<AsmToken> &t, size_t i) { return isDead(t, i+2, EFFECT_C) && isDeadAt(t, t[i+1].label, EFFECT_C); },
+        [](const std::vector<AsmToken> &t, size_t i) {
+            auto token = AsmToken(invert(t[i+1].opcode));
+            token.label = t[i+1].label;
+            return std::vector<AsmToken>{ token };
+        }
+    },
+    {
+        "dead-load",
+        { LoadC },
+        [](const std::vector<AsmToken> &t, size_t i) { return isDead(t, i+1, EFFECT_C); },
+        [](const std::vector<AsmToken> &t, size_t i) { return std::vector<AsmToken>{}; }
+    },
+};
+
+static bool matches(const PeepholeRule &rule, const std::vector<AsmToken> &asmTokens, size_t start) {
+    if (start + rule.pattern.size() > asmTokens.size())
+        return false;
+
+    for (size_t i = 0; i < rule.pattern.size(); i++) {
+        const auto &token = asmTokens[start+i];
+        const auto &opcodes = rule.pattern[i];
+
+        if (std::find(opcodes.begin(), opcodes.end(), token.opcode) == opcodes.end())
+            return false;
+
+        // Only the first instruction of a window may be a jump target
+        if (i > 0 && hasLabel(token))
+            return false;
+    }
+
+    return !rule.guard || rule.guard(asmTokens, start);
+}
+
+static bool peephole(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits) {
+    std::vector<AsmToken> output;
     size_t current = 0;
+    bool changed = false;
 
     while (current < asmTokens.size()) {
-        auto asmToken = asmTokens[current++];
-        if (asmToken.isNone() && current < asmTokens.size()) {
-            auto next = asmTokens[current++];
-
-            if (asmToken.opcode == OpCode::PUSHC && next.opcode == OpCode::POPC) {
-                output.push_back(AsmToken(OpCode::NOP).setLabel(asmToken.label));
-                output.push_back(AsmToken(OpCode::NOP).setLabel(next.label));
-            } else if (asmToken.opcode == OpCode::PUSHC && next.opcode == OpCode::POPA) {
-                output.push_back(AsmToken(OpCode::MOVCA).setLabel(asmToken.label));
-                output.push_back(AsmToken(OpCode::NOP).setLabel(next.label));
-            } else if (asmToken.opcode == OpCode::PUSHC && next.opcode == OpCode::POPB) {
-                output.push_back(AsmToken(OpCode::MOVCB).setLabel(asmToken.label));
-                output.push_back(AsmToken(OpCode::NOP).setLabel(next.label));
-            } else if (asmToken.opcode == OpCode::PUSHC && next.opcode == OpCode::POPIDX) {
-                output.push_back(AsmToken(OpCode::MOVCIDX).setLabel(asmToken.label));
-                output.push_back(AsmToken(OpCode::NOP).setLabel(next.label));
-            } else {
-                output.push_back(asmToken);
-                output.push_back(next);
+        auto rule = std::find_if(PeepholeRules.begin(), PeepholeRules.end(), [&](const PeepholeRule &rule) {
+            return matches(rule, asmTokens, current);
+        });
+
+        if (rule == PeepholeRules.end()) {
+            output.push_back(asmTokens[current++]);
+            continue;
+        }
+
+        auto replacement = rule->rewrite(asmTokens, current);
+        auto label = hasLabel(asmTokens[current]) ? asmTokens[current].label : "";
+
+        if (label.size()) {
+            if (replacement.empty() || OpCodeDefinition[OpCodeAsString(replacement[0].opcode)].second == ArgType::LABEL) {
+                replacement.insert(replacement.begin(), AsmToken(OpCode::NOP));
             }
-        } else {
-            output.push_back(asmToken);
+
+            replacement[0].setLabel(label);
         }
+
+        output.insert(output.end(), replacement.begin(), replacement.end());
+
+        current += rule->pattern.size();
+        hits[rule->name]++;
+        changed = true;
     }
 
+    asmTokens = output;
+
+    return changed;
+}
+
+static size_t skipNops(const std::vector<AsmToken> &asmTokens, size_t i) {
+    while (i < asmTokens.size() && asmTokens[i].opcode == OpCode::NOP)
+        i++;
+
+    return i;
+}
+
+// Where execution continues after jumping to `label', past any NOPs.
+static size_t destination(const std::vector<AsmToken> &asmTokens, const std::map<std::string, size_t> &labels, const std::string &label) {
+    auto found = labels.find(label);
+
+    if (found == labels.end())
+        return asmTokens.size();
+
+    return skipNops(asmTokens, found->second);
+}
+
+static bool threadJumps(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits) {
+    std::map<std::string, size_t> labels;
+    std::vector<AsmToken> output;
+    bool changed = false;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        if (hasLabel(asmTokens[i]))
+            labels[asmTokens[i].label] = i;
+    }
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        auto token = asmTokens[i];
+
+        // Jump table entries are found by position, so none of them may go
+        if (token.opcode == OpCode::JMPIDX) {
+            size_t entries = std::get<int16_t>(*token.arg);
+            size_t end = std::min(i+1+entries, asmTokens.size());
+
+            output.insert(output.end(), asmTokens.begin()+i, asmTokens.begin()+end);
+            i = end-1;
+            continue;
+        }
+
+        if (!OpCodeIsJump(token.opcode)) {
+            output.push_back(token);
+            continue;
+        }
+
+        // A jump to a JMP, or to a conditional jump on the same condition,
+        // can go straight to that jump's target since C is unchanged.
+        std::vector<std::string> seen = { token.label };
+        for (;;) {
+            auto dst = destination(asmTokens, labels, token.label);
+
+            if (dst >= asmTokens.size())
+                break;
+
+            const auto &next = asmTokens[dst];
+
+            if (next.opcode != OpCode::JMP && next.opcode != token.opcode)
+                break;
+
+            if (std::find(seen.begin(), seen.end(), next.label) != seen.end())
+                break;
+
+            token.label = next.label;
+            seen.push_back(next.label);
+            hits["jump-thread"]++;
+            changed = true;
+        }
+
+        auto fallthrough = skipNops(asmTokens, i+1);
+
+        if (destination(asmTokens, labels, token.label) == fallthrough) {
+            hits["jump-to-next"]++;
+            changed = true;
+            continue;
+        }
+
+        // JMPEZ L1; JMP L2; L1: becomes JMPNZ L2
+        if (token.opcode != OpCode::JMP && i+1 < asmTokens.size() && asmTokens[i+1].opcode == OpCode::JMP &&
+            destination(asmTokens, labels, token.label) == skipNops(asmTokens, i+2)) {
+            token.opcode = invert(token.opcode);
+            token.label = asmTokens[i+1].label;
+            output.push_back(token);
+            i++;
+            hits["branch-inversion"]++;
+            changed = true;
+            continue;
+        }
+
+        output.push_back(token);
+    }
+
+    asmTokens = output;
+
+    return changed;
+}
+
+std::vector<AsmToken> optimise(const int cpu, const std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits, const FunctionLabels &functions) {
+    std::vector<AsmToken> output = asmTokens;
+    bool changed = true;
+
+    while (changed) {
+        changed = peephole(output, hits);
+        changed = threadJumps(output, hits) || changed;
+        changed = removeUnreachable(output, hits) || changed;
+        changed = forwardMemory(output, hits) || changed;
+    }
+
+    // Last, as the peephole rules only know the generic operations
+    specialise(output, functions, hits);
+
     return output;
 }
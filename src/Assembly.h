@@ -80,6 +80,10 @@ struct AsmToken {
     std::string toString() const;
 };
 
-std::vector<AsmToken> optimise(const int cpu, const std::vector<AsmToken> &asmTokens);
+// The entry and end labels of each function the compiler laid out
+typedef std::vector<std::pair<std::string, std::string>> FunctionLabels;
+
+bool isDead(const std::vector<AsmToken> &asmTokens, size_t start, Effect reg);
+std::vector<AsmToken> optimise(const int cpu, const std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits, const FunctionLabels &functions=FunctionLabels());
 
 #endif //__ASSEMBLY_H__
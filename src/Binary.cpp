@@ -158,12 +158,23 @@ void Binary::updateShort(uint32_t pos, int16_t s) {
 std::vector<uint8_t> Binary::translate(const std::vector<AsmToken> &tokens) {
     std::map<std::string, uint32_t> labels;
     std::map<uint32_t, std::string> jumps;
+    std::vector<std::string> pending;
 
-    for (auto token : tokens) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const auto &token = tokens[i];
         uint32_t pos = 0;
 
         auto argtype = OpCodeDefinition[OpCodeAsString(token.opcode)].second;
 
+        // NOPs are not encoded, their labels resolve to the next instruction
+        // instead. A trailing NOP is kept so that its labels still point
+        // inside the code.
+        if (token.opcode == OpCode::NOP && i+1 < tokens.size()) {
+            if (token.label.size())
+                pending.push_back(token.label);
+            continue;
+        }
+
         if (token.isNone()) {
             if (argtype == ArgType::LABEL) {
                 pos = addShort(token.opcode, 0);
@@ -189,6 +200,11 @@ std::vector<uint8_t> Binary::translate(const std::vector<AsmToken> &tokens) {
             pos = addSyscall(token.opcode, syscall.first, syscall.second);
         }
 
+        for (const auto &label : pending) {
+            labels[label] = pos;
+        }
+        pending.clear();
+
         if (token.label.size()) {
             if (argtype == ArgType::LABEL) {
                 jumps[pos] = token.label;
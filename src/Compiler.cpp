@@ -2,10 +2,13 @@
 
 #include <sstream>
 #include <stack>
+#include <set>
 #include <algorithm>
 #include <numeric>
+#include <cmath>
 
 #include "Environment.h"
+#include "Flow.h"
 
 #define FRAME_INDEX "FRAME"
 
@@ -13,6 +16,28 @@ static size_t current = 0;
 
 static std::shared_ptr<Environment> env;
 
+static bool optimising = false;
+
+// Functions whose bodies are copied into their callers under -O. Only leaf
+// functions no longer than inlineLimit instructions qualify.
+struct Inlinable {
+    size_t params;
+    int32_t frame;
+    std::vector<AsmToken> body;
+};
+
+static std::map<std::string, Inlinable> inlinable;
+static size_t inlineLimit = 0;
+
+// Where each function's code starts and ends, for the passes that need to
+// know whose frame an instruction addresses
+static FunctionLabels functionLabels;
+
+// Under -O the blocks freed for each struct type are kept in a list for its
+// constructor to take before allocating. The global holding the head of the
+// list for each struct, linked through the first slot of each block.
+static std::map<std::string, int32_t> pools;
+
 static ValueType expression(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, int rbp);
 
 static const ValueType None(SimpleType::NONE);
@@ -62,7 +87,12 @@ static void error(const Token &token, const std::string &err) {
     throw std::domain_error(s.str());
 }
 
+static bool warnings = true;
+
 static void warning(const Token &token, const std::string &warn) {
+    if (!warnings)
+        return;
+
     std::ostringstream s;
     s << "Warning at " << token.line << " position " << token.position << ": " << warn;
     //throw std::domain_error(s.str());
@@ -105,46 +135,164 @@ static void check(const Token &token, TokenType type, const std::string &err) {
         error(token, token.str + " " + err);
 }
 
+// Operands that have been pushed by the expression compiler but not yet
+// written out. Each entry is either a leaf load (SETC, LOADC or READC) that
+// can be issued straight into whichever register pops it, or a PUSHC for a
+// value that is still live in C. A PUSHC entry can only sit at the bottom,
+// so spilling in order never overwrites a live C.
+static std::vector<AsmToken> operands;
+
+static void spill(std::vector<AsmToken> &asmTokens) {
+    for (const auto &operand : operands) {
+        if (operand.opcode != OpCode::PUSHC)
+            asmTokens.push_back(operand);
+        asmTokens.push_back(AsmToken(OpCode::PUSHC));
+    }
+
+    operands.clear();
+}
+
+static AsmToken retarget(const AsmToken &operand, OpCode opcode) {
+    auto token = operand;
+
+    if (opcode == OpCode::POPA) {
+        token.opcode = operand.opcode == OpCode::SETC ? OpCode::SETA : operand.opcode == OpCode::LOADC ? OpCode::LOADA : OpCode::READA;
+    } else {
+        token.opcode = operand.opcode == OpCode::SETC ? OpCode::SETB : operand.opcode == OpCode::LOADC ? OpCode::LOADB : OpCode::READB;
+    }
+
+    return token;
+}
+
+static void emit(std::vector<AsmToken> &asmTokens, const AsmToken &token) {
+    if (!optimising) {
+        asmTokens.push_back(token);
+        return;
+    }
+
+    bool labelled = token.label.size() && OpCodeDefinition[OpCodeAsString(token.opcode)].second != ArgType::LABEL;
+
+    if (labelled) {
+        spill(asmTokens);
+        asmTokens.push_back(token);
+        return;
+    }
+
+    if (token.opcode == OpCode::PUSHC) {
+        spill(asmTokens);
+        operands.push_back(token);
+        return;
+    }
+
+    if (operands.empty()) {
+        asmTokens.push_back(token);
+        return;
+    }
+
+    auto top = operands.back();
+
+    if (token.opcode == OpCode::POPA || token.opcode == OpCode::POPB || token.opcode == OpCode::POPC || token.opcode == OpCode::POPIDX) {
+        operands.pop_back();
+
+        if (top.opcode == OpCode::PUSHC) {
+            if (token.opcode == OpCode::POPA) {
+                asmTokens.push_back(AsmToken(OpCode::MOVCA));
+            } else if (token.opcode == OpCode::POPB) {
+                asmTokens.push_back(AsmToken(OpCode::MOVCB));
+            } else if (token.opcode == OpCode::POPIDX) {
+                asmTokens.push_back(AsmToken(OpCode::MOVCIDX));
+            }
+        } else if (token.opcode == OpCode::POPA || token.opcode == OpCode::POPB) {
+            asmTokens.push_back(retarget(top, token.opcode));
+        } else {
+            spill(asmTokens);
+            asmTokens.push_back(top);
+
+            if (token.opcode == OpCode::POPIDX)
+                asmTokens.push_back(AsmToken(OpCode::MOVCIDX));
+        }
+
+        return;
+    }
+
+    auto effects = OpCodeReads(token.opcode) | OpCodeWrites(token.opcode);
+    bool inC = operands.front().opcode == OpCode::PUSHC;
+    bool leaves = operands.size() > (inC ? 1 : 0);
+    bool loads = std::any_of(operands.begin(), operands.end(), [](const AsmToken &operand) {
+        return operand.opcode == OpCode::LOADC || operand.opcode == OpCode::READC;
+    });
+
+    if ((effects & (EFFECT_STACK|EFFECT_CONTROL)) ||
+        (leaves && (effects & EFFECT_C)) ||
+        (inC && (OpCodeWrites(token.opcode) & EFFECT_C)) ||
+        (loads && (OpCodeWrites(token.opcode) & EFFECT_MEMORY))) {
+        spill(asmTokens);
+    }
+
+    asmTokens.push_back(token);
+}
+
+// Push a leaf value (SETC, LOADC or READC). Nothing is emitted until the
+// value is consumed, so a leaf that is popped straight into A or B costs a
+// single load instead of a load, a push and a pop.
+static void pushOperand(std::vector<AsmToken> &asmTokens, const AsmToken &token) {
+    if (!optimising) {
+        asmTokens.push_back(token);
+        asmTokens.push_back(AsmToken(OpCode::PUSHC));
+        return;
+    }
+
+    operands.push_back(token);
+}
+
 static void add(std::vector<AsmToken> &asmTokens, OpCode opcode, const std::string label="") {
     auto token = AsmToken(opcode);
     token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
 }
 
 static void addShort(std::vector<AsmToken> &asmTokens, OpCode opcode, int16_t v, const std::string label="") {
     auto token = AsmToken(opcode, v);
     token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
 }
 
 static void addPointer(std::vector<AsmToken> &asmTokens, OpCode opcode, int32_t v, const std::string label="") {
     auto token = AsmToken(opcode, v);
     token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
 }
 
 static void addString(std::vector<AsmToken> &asmTokens, OpCode opcode, const std::string &v, const std::string label="") {
     auto token = AsmToken(opcode,v );
     token.label = label;
-    asmTokens.push_back(token);
-}
-
-static void addFloat(std::vector<AsmToken> &asmTokens, OpCode opcode, const float v, const std::string label="") {
-    auto token = AsmToken(opcode, v);
-    token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
 }
 
 static void addValue16(std::vector<AsmToken> &asmTokens, OpCode opcode, const uint32_t &v, const std::string label="") {
     auto token = AsmToken(opcode, v);
     token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
 }
 
 static void addSyscall(std::vector<AsmToken> &asmTokens, OpCode opcode, SysCall syscall, RuntimeValue r, const std::string label="") {
     auto token = AsmToken(opcode, std::make_pair(syscall, r));
     token.label = label;
-    asmTokens.push_back(token);
+    emit(asmTokens, token);
+}
+
+// Writes a constant operand at IDX as data, leaving IDX where it is. Under
+// -O constant array elements and struct arguments go in this way rather
+// than through C.
+static void addData(std::vector<AsmToken> &asmTokens, const AsmToken &operand) {
+    const uint32_t BYTE_BIT = 0x00010000;
+
+    if (operand.isFloat()) {
+        emit(asmTokens, AsmToken(OpCode::FDATA, std::get<float>(*operand.arg)));
+    } else {
+        auto value = std::get<uint32_t>(*operand.arg);
+        addShort(asmTokens, (value & BYTE_BIT) ? OpCode::BDATA : OpCode::IDATA, (int16_t)(value & 0xFFFF));
+    }
 }
 
 static uint32_t Int16AsValue(int16_t i) {
@@ -160,6 +308,475 @@ static uint32_t ByteAsValue(int16_t i) {
     return (uint32_t)(QNAN|BYTE_BIT|(uint16_t)i);
 }
 
+// String lengths known at compile time. Under -O a length is carried from
+// literals through strcat, strcpy, variables and function results, but only
+// where nothing can change it: a variable that is assigned or declared more
+// than once loses its length, as does every string once the program is seen
+// to write into one through an index, since any other name may alias it.
+static std::set<std::string> reassigned;
+static bool trackLengths = false;
+static bool stringsModified = false;
+
+static std::set<std::string> reassignedNames(const std::vector<Token> &tokens) {
+    static const std::set<TokenType> assignments = {
+        TokenType::ASSIGN, TokenType::PLUS_ASSIGN, TokenType::MINUS_ASSIGN, TokenType::STAR_ASSIGN,
+        TokenType::SLASH_ASSIGN, TokenType::BACKSLASH_ASSIGN, TokenType::PERCENT_ASSIGN,
+        TokenType::LEFT_SHIFT_ASSIGN, TokenType::RIGHT_SHIFT_ASSIGN, TokenType::AMPERSAND_ASSIGN,
+        TokenType::PIPE_ASSIGN, TokenType::CARAT_ASSIGN, TokenType::INCREMENT, TokenType::DECREMENT,
+    };
+
+    std::set<std::string> names;
+    std::set<std::string> declared;
+
+    for (size_t i = 0; i+1 < tokens.size(); i++) {
+        if (tokens[i].type != TokenType::IDENTIFIER)
+            continue;
+
+        bool declaration = i > 0 && tokens[i-1].type == TokenType::VAR;
+
+        if (declaration && !declared.insert(tokens[i].str).second)
+            names.insert(tokens[i].str);
+
+        if (!declaration && assignments.count(tokens[i+1].type))
+            names.insert(tokens[i].str);
+
+        if (i > 0 && (tokens[i-1].type == TokenType::INCREMENT || tokens[i-1].type == TokenType::DECREMENT))
+            names.insert(tokens[i].str);
+    }
+
+    return names;
+}
+
+static std::optional<size_t> knownLength(const String &_string) {
+    if (optimising)
+        return _string.length;
+
+    if (_string.literal.size())
+        return _string.literal.size();
+
+    return std::nullopt;
+}
+
+static ValueType withoutLength(const ValueType &type) {
+    if (std::holds_alternative<String>(type)) {
+        auto _string = std::get<String>(type);
+        _string.length = std::nullopt;
+        return _string;
+    }
+
+    return type;
+}
+
+// The type to record for `name', dropping a length that cannot be relied on
+static ValueType settled(const std::string &name, const ValueType &type) {
+    if (!trackLengths || reassigned.count(name))
+        return withoutLength(type);
+
+    return type;
+}
+
+// Constant folding. While operands are tracked a literal or `val' is still
+// a pending SETC leaf when its operator is compiled, so the operator can be
+// evaluated here instead. A fold is only made when the result can be
+// represented in the type the expression has at runtime; anything else is
+// left for the VM.
+static bool isConstant(const AsmToken &operand) {
+    const uint32_t QNAN = 0x7F800000;
+    const uint32_t SIGN = 0x80000000;
+
+    if (operand.opcode != OpCode::SETC || operand.isNone())
+        return false;
+
+    if (operand.isFloat())
+        return true;
+
+    return std::holds_alternative<uint32_t>(*operand.arg) && (std::get<uint32_t>(*operand.arg) & (QNAN|SIGN)) == QNAN;
+}
+
+static bool isByteConstant(const AsmToken &operand) {
+    const uint32_t BYTE_BIT = 0x00010000;
+
+    return !operand.isFloat() && (std::get<uint32_t>(*operand.arg) & BYTE_BIT);
+}
+
+static int32_t integerConstant(const AsmToken &operand) {
+    return (int16_t)(std::get<uint32_t>(*operand.arg) & 0xFFFF);
+}
+
+static float floatConstant(const AsmToken &operand) {
+    return operand.isFloat() ? std::get<float>(*operand.arg) : (float)integerConstant(operand);
+}
+
+static bool pendingConstants(size_t count) {
+    if (!optimising || operands.size() < count)
+        return false;
+
+    return std::all_of(operands.end() - count, operands.end(), isConstant);
+}
+
+static bool replaceConstants(size_t count, int32_t value, bool byte) {
+    if (byte ? (value < 0 || value > 255) : (value < INT16_MIN || value > INT16_MAX))
+        return false;
+
+    operands.erase(operands.end() - count, operands.end());
+    operands.push_back(AsmToken(OpCode::SETC, byte ? ByteAsValue(value) : Int16AsValue(value)));
+
+    return true;
+}
+
+static bool replaceConstants(size_t count, float value) {
+    if (!std::isfinite(value))
+        return false;
+
+    operands.erase(operands.end() - count, operands.end());
+    operands.push_back(AsmToken(OpCode::SETC, value));
+
+    return true;
+}
+
+static bool foldBinary(OpCode opcode) {
+    if (!pendingConstants(2))
+        return false;
+
+    auto lhs = operands[operands.size()-2];
+    auto rhs = operands.back();
+
+    if (opcode == OpCode::POW) {
+        return replaceConstants(2, std::pow(floatConstant(lhs), floatConstant(rhs)));
+    } else if (lhs.isFloat() && rhs.isFloat()) {
+        float a = floatConstant(lhs);
+        float b = floatConstant(rhs);
+
+        switch (opcode) {
+            case OpCode::ADD: return replaceConstants(2, a + b);
+            case OpCode::SUB: return replaceConstants(2, a - b);
+            case OpCode::MUL: return replaceConstants(2, a * b);
+            case OpCode::DIV: return b != 0 && replaceConstants(2, a / b);
+            default: return false;
+        }
+    } else if (!lhs.isFloat() && !rhs.isFloat()) {
+        int32_t a = integerConstant(lhs);
+        int32_t b = integerConstant(rhs);
+        bool byte = isByteConstant(lhs) && isByteConstant(rhs);
+
+        switch (opcode) {
+            case OpCode::ADD: return replaceConstants(2, a + b, byte);
+            case OpCode::SUB: return replaceConstants(2, a - b, byte);
+            case OpCode::MUL: return replaceConstants(2, a * b, byte);
+            case OpCode::IDIV: return b != 0 && replaceConstants(2, a / b, byte);
+            case OpCode::MOD: return b != 0 && replaceConstants(2, a % b, byte);
+            case OpCode::LSHIFT: return b >= 0 && b < 16 && replaceConstants(2, a * (1 << b), byte);
+            case OpCode::RSHIFT: return a >= 0 && b >= 0 && b < 16 && replaceConstants(2, a >> b, byte);
+            case OpCode::BAND: return replaceConstants(2, (int16_t)(a & b), byte);
+            case OpCode::BOR: return replaceConstants(2, (int16_t)(a | b), byte);
+            case OpCode::XOR: return replaceConstants(2, (int16_t)(a ^ b), byte);
+            default: return false;
+        }
+    }
+
+    return false;
+}
+
+static bool foldUnary(OpCode opcode) {
+    if (!pendingConstants(1))
+        return false;
+
+    auto operand = operands.back();
+
+    switch (opcode) {
+        case OpCode::SUB:
+            if (operand.isFloat())
+                return replaceConstants(1, -floatConstant(operand));
+            return !isByteConstant(operand) && replaceConstants(1, -integerConstant(operand), false);
+        case OpCode::BNOT:
+            return !operand.isFloat() && !isByteConstant(operand) && replaceConstants(1, (int16_t)~integerConstant(operand), false);
+        case OpCode::FLT: return replaceConstants(1, floatConstant(operand));
+        case OpCode::ATAN: return replaceConstants(1, std::atan(floatConstant(operand)));
+        case OpCode::COS: return replaceConstants(1, std::cos(floatConstant(operand)));
+        case OpCode::EXP: return replaceConstants(1, std::exp(floatConstant(operand)));
+        case OpCode::LOG: return replaceConstants(1, std::log(floatConstant(operand)));
+        case OpCode::SIN: return replaceConstants(1, std::sin(floatConstant(operand)));
+        case OpCode::SQR: return replaceConstants(1, std::sqrt(floatConstant(operand)));
+        case OpCode::TAN: return replaceConstants(1, std::tan(floatConstant(operand)));
+        default: return false;
+    }
+}
+
+// Replaces the array base and index on the stack with the address of the
+// element, for elements `offset' cells apart. The stride is applied after
+// the index has been computed, so the index expression cannot clobber it.
+// Only an Integer or Byte index may be scaled with a shift; any other index
+// keeps MUL, which also copes with a float.
+static void addIndex(std::vector<AsmToken> &asmTokens, int offset, const ValueType &indexType) {
+    if (pendingConstants(1) && !operands.back().isFloat()) {
+        int32_t index = integerConstant(operands.back()) * offset;
+
+        if (index >= INT16_MIN && index <= INT16_MAX) {
+            operands.pop_back();
+
+            if (index == 0)
+                return;
+
+            pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(index)));
+
+            add(asmTokens, OpCode::POPB);
+            add(asmTokens, OpCode::POPA);
+            add(asmTokens, OpCode::ADD);
+            add(asmTokens, OpCode::PUSHC);
+            return;
+        }
+    }
+
+    if (offset != 1) {
+        add(asmTokens, OpCode::POPA);
+
+        if ((offset & (offset - 1)) == 0 && (indexType == Integer || indexType == Byte)) {
+            int shift = 0;
+            while ((1 << shift) != offset)
+                shift++;
+
+            addValue16(asmTokens, OpCode::SETB, Int16AsValue(shift));
+            add(asmTokens, OpCode::LSHIFT);
+        } else {
+            addValue16(asmTokens, OpCode::SETB, Int16AsValue(offset));
+            add(asmTokens, OpCode::MUL);
+        }
+
+        add(asmTokens, OpCode::PUSHC);
+    }
+
+    add(asmTokens, OpCode::POPB);
+    add(asmTokens, OpCode::POPA);
+    add(asmTokens, OpCode::ADD);
+    add(asmTokens, OpCode::PUSHC);
+}
+
+// Allocates a block for the struct into IDX, from its pool when it has one
+static void allocate(std::vector<AsmToken> &asmTokens, const Struct &_struct) {
+    static int POOLs = 1;
+
+    auto pool = pools.find(_struct.name);
+
+    if (pool == pools.end()) {
+        addShort(asmTokens, OpCode::ALLOC, _struct.size());
+        return;
+    }
+
+    auto prefix = "POOL_" + std::to_string(POOLs++);
+
+    addPointer(asmTokens, OpCode::LOADC, pool->second);
+    add(asmTokens, OpCode::JMPEZ, prefix + "_EMPTY");
+    add(asmTokens, OpCode::MOVCIDX);
+    add(asmTokens, OpCode::IDXC);
+    addPointer(asmTokens, OpCode::STOREC, pool->second);
+    add(asmTokens, OpCode::JMP, prefix + "_END");
+    add(asmTokens, OpCode::NOP, prefix + "_EMPTY");
+    addShort(asmTokens, OpCode::ALLOC, _struct.size());
+    add(asmTokens, OpCode::NOP, prefix + "_END");
+}
+
+// Frees the block in IDX, back into its pool when it is a struct with one
+static void deallocate(std::vector<AsmToken> &asmTokens, const ValueType &type) {
+    if (std::holds_alternative<Struct>(type)) {
+        auto pool = pools.find(std::get<Struct>(type).name);
+
+        if (pool != pools.end()) {
+            addPointer(asmTokens, OpCode::LOADC, pool->second);
+            add(asmTokens, OpCode::WRITECX);
+            addPointer(asmTokens, OpCode::SAVEIDX, pool->second);
+            return;
+        }
+    }
+
+    add(asmTokens, OpCode::FREEIDX);
+}
+
+// The tail of strcat. Takes [LEN L,L,LEN R,R] off the stack and leaves the
+// joined copy in IDX.
+static void concatenate(std::vector<AsmToken> &asmTokens) {
+    // A = LEN L, B = LEN R, C = L, IDX = R
+    add(asmTokens, OpCode::POPIDX);
+    add(asmTokens, OpCode::POPB);
+    add(asmTokens, OpCode::POPC);
+    add(asmTokens, OpCode::POPA);
+
+    // STACK = [L,R]
+    add(asmTokens, OpCode::PUSHIDX);
+    add(asmTokens, OpCode::PUSHC);
+
+    add(asmTokens, OpCode::ADD);
+    addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
+
+    add(asmTokens, OpCode::CALLOC);
+
+    // A = LEN L, B = LEN R, C = LEN N, IDX = N
+
+    add(asmTokens, OpCode::PUSHA);
+    // STACK = [LEN L,L,R]
+
+    add(asmTokens, OpCode::POPC);
+    // A = LEN L, B = LEN R, C = LEN L, IDX = N
+    // STACK = [L,R]
+
+    add(asmTokens, OpCode::POPA);
+    // A = L, B = LEN R, C = LEN L, IDX = N
+    // STACK = [R]
+
+    add(asmTokens, OpCode::PUSHB);
+    // STACK = [LEN R,R]
+
+    add(asmTokens, OpCode::PUSHA);
+    // STACK = [L, LEN R,R]
+
+    add(asmTokens, OpCode::POPB);
+    // A = L, B = L, C = LEN L, IDX = N
+    // STACK = [LEN R,R]
+
+    add(asmTokens, OpCode::PUSHIDX);
+    // STACK = [N,LEN R,R]
+
+    add(asmTokens, OpCode::POPA);
+    // A = N, B = L, C = LEN L, IDX = N
+    // STACK = [LEN R,R]
+
+    add(asmTokens, OpCode::COPY);
+
+    add(asmTokens, OpCode::PUSHC);
+    // STACK = [LEN L,LEN R,R]
+
+    add(asmTokens, OpCode::POPB);
+    // A = N, B = LEN L, C = LEN L, IDX = N
+    // STACK = [LEN R,R]
+
+    add(asmTokens, OpCode::ADD);
+    // A = N, B = LEN L, C = N+L, IDX = N
+
+    add(asmTokens, OpCode::PUSHC);
+    // STACK = [N+L,LEN R,R]
+
+    add(asmTokens, OpCode::POPA);
+    // A = N+L, B = LEN L, C = N+L, IDX = N
+    // STACK = [LEN R,R]
+
+    add(asmTokens, OpCode::POPC);
+    // A = N+L, B = LEN L, C = LEN R, IDX = N
+    // STACK = [R]
+
+    add(asmTokens, OpCode::POPB);
+    // A = N+L, B = R, C = LEN R, IDX = N
+    // STACK = []
+
+    add(asmTokens, OpCode::COPY);
+}
+
+// The body of strcmp. Compares the strings in A and B and leaves the result
+// in C, jumping to `prefix'_DONE once it is known.
+static void compare(std::vector<AsmToken> &asmTokens, const std::string &prefix) {
+    add(asmTokens, OpCode::PUSHA);
+    add(asmTokens, OpCode::POPIDX);
+
+    add(asmTokens, OpCode::EQ);
+    add(asmTokens, OpCode::NOT);
+    add(asmTokens, OpCode::JMPEZ, prefix + "_DONE");
+
+    add(asmTokens, OpCode::CMP, prefix + "_CMP");
+    add(asmTokens, OpCode::JMPNZ, prefix + "_DONE");
+
+    add(asmTokens, OpCode::IDXC);
+    add(asmTokens, OpCode::JMPEZ, prefix + "_DONE");
+
+    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+    addValue16(asmTokens, OpCode::INCA, Int16AsValue(1));
+    addValue16(asmTokens, OpCode::INCB, Int16AsValue(1));
+
+    add(asmTokens, OpCode::JMP, prefix + "_CMP");
+}
+
+// The tail of strcpy. Takes the string in IDX and its length in C and leaves
+// the copy in IDX.
+static void duplicate(std::vector<AsmToken> &asmTokens) {
+    add(asmTokens, OpCode::PUSHC);
+
+    addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
+
+    add(asmTokens, OpCode::PUSHIDX);
+    add(asmTokens, OpCode::POPB);
+    add(asmTokens, OpCode::CALLOC);
+    add(asmTokens, OpCode::PUSHIDX);
+    add(asmTokens, OpCode::POPA);
+    add(asmTokens, OpCode::POPC);
+
+    add(asmTokens, OpCode::COPY);
+}
+
+// The body of substr. Takes [S,BEGIN,LEN] off the stack and leaves the copy
+// in IDX.
+static void extract(std::vector<AsmToken> &asmTokens) {
+    add(asmTokens, OpCode::POPC);
+    add(asmTokens, OpCode::PUSHC);
+
+    addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
+
+    add(asmTokens, OpCode::CALLOC);
+    add(asmTokens, OpCode::POPC);
+
+    add(asmTokens, OpCode::POPB);
+    add(asmTokens, OpCode::POPA);
+
+    add(asmTokens, OpCode::PUSHC);
+    add(asmTokens, OpCode::ADD);
+
+    add(asmTokens, OpCode::PUSHC);
+    add(asmTokens, OpCode::POPB);
+
+    add(asmTokens, OpCode::PUSHIDX);
+    add(asmTokens, OpCode::POPA);
+    add(asmTokens, OpCode::POPC);
+
+    add(asmTokens, OpCode::COPY);
+}
+
+// Under -O strlen and strcmp are single STRLEN and STRCMP opcodes, and the
+// builtins that allocate call shared routines instead of expanding in place.
+// Only the routines a program calls are emitted, once, at its start.
+static std::set<std::string> runtime;
+
+static void runtimeCall(std::vector<AsmToken> &asmTokens, const std::string &name) {
+    runtime.insert(name);
+    add(asmTokens, OpCode::CALL, name);
+}
+
+static void runtimeRoutines(std::vector<AsmToken> &asmTokens) {
+    if (runtime.empty())
+        return;
+
+    add(asmTokens, OpCode::JMP, "RUNTIME_END");
+
+    // IDX = S, C = LEN S -> IDX = COPY
+    if (runtime.count("RUNTIME_STRCPY")) {
+        add(asmTokens, OpCode::NOP, "RUNTIME_STRCPY");
+        duplicate(asmTokens);
+        add(asmTokens, OpCode::RETURN);
+    }
+
+    // STACK = [LEN L,L,LEN R,R] -> IDX = L+R
+    if (runtime.count("RUNTIME_STRCAT")) {
+        add(asmTokens, OpCode::NOP, "RUNTIME_STRCAT");
+        concatenate(asmTokens);
+        add(asmTokens, OpCode::RETURN);
+    }
+
+    // STACK = [S,BEGIN,LEN] -> IDX = SUB
+    if (runtime.count("RUNTIME_SUBSTR")) {
+        add(asmTokens, OpCode::NOP, "RUNTIME_SUBSTR");
+        extract(asmTokens);
+        add(asmTokens, OpCode::RETURN);
+    }
+
+    add(asmTokens, OpCode::NOP, "RUNTIME_END");
+    spill(asmTokens);
+}
+
 static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
     auto token = tokens[current];
 
@@ -190,6 +807,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `atan': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::ATAN))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::ATAN);
         add(asmTokens, OpCode::PUSHC);
@@ -219,6 +839,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `cos': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::COS))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::COS);
         add(asmTokens, OpCode::PUSHC);
@@ -329,6 +952,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `exp': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::EXP))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::EXP);
         add(asmTokens, OpCode::PUSHC);
@@ -340,6 +966,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `float': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::FLT))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::FLT);
         add(asmTokens, OpCode::PUSHC);
@@ -362,7 +991,7 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
             error(token, "Function `free': Cannot free a scalar value");
         }
 
-        add(asmTokens, OpCode::FREEIDX);
+        deallocate(asmTokens, type);
 
         return None;
     } else if (token.str == "getc") {
@@ -416,6 +1045,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `log': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::LOG))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::LOG);
         add(asmTokens, OpCode::PUSHC);
@@ -522,6 +1154,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (right_type == None || right_type == Undefined)
             error(token, "Function `pow': Cannot assign a void value to parameter 2");
 
+        if (foldBinary(OpCode::POW))
+            return Float;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::POW);
@@ -595,6 +1230,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `sin': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::SIN))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::SIN);
         add(asmTokens, OpCode::PUSHC);
@@ -630,6 +1268,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `sqrt': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::SQR))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::SQR);
         add(asmTokens, OpCode::PUSHC);
@@ -650,16 +1291,23 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
         static int STRCATs = 1;
 
+        std::optional<size_t> llength, rlength;
+
         if (ltype == None || ltype == Undefined)
             error(token, "Function `strcat': Cannot assign a void value to parameter 1");
 
         if (std::holds_alternative<String>(ltype)) {
             auto _string = std::get<String>(ltype);
+            auto length = llength = knownLength(_string);
 
             add(asmTokens, OpCode::POPIDX);
 
-            if (_string.literal.size()) {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(_string.literal.size()));
+            if (length) {
+                addValue16(asmTokens, OpCode::SETC, Int16AsValue(*length));
+                add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::PUSHIDX);
+            } else if (optimising) {
+                add(asmTokens, OpCode::STRLEN);
                 add(asmTokens, OpCode::PUSHC);
                 add(asmTokens, OpCode::PUSHIDX);
             } else {
@@ -695,11 +1343,16 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
         if (std::holds_alternative<String>(rtype)) {
             auto _string = std::get<String>(rtype);
+            auto length = rlength = knownLength(_string);
 
             add(asmTokens, OpCode::POPIDX);
 
-            if (_string.literal.size()) {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(_string.literal.size()));
+            if (length) {
+                addValue16(asmTokens, OpCode::SETC, Int16AsValue(*length));
+                add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::PUSHIDX);
+            } else if (optimising) {
+                add(asmTokens, OpCode::STRLEN);
                 add(asmTokens, OpCode::PUSHC);
                 add(asmTokens, OpCode::PUSHIDX);
             } else {
@@ -710,101 +1363,38 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
                 addValue16(asmTokens, OpCode::SETB, Int16AsValue(0));
 
                 add(asmTokens, OpCode::IDXA, "STRCAT_" + std::to_string(_strcat) + "_CHECK");
-                add(asmTokens, OpCode::CMP);
-                add(asmTokens, OpCode::JMPEZ, "STRCAT_" + std::to_string(_strcat) + "_FALSE");
-                addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
-                add(asmTokens, OpCode::JMP, "STRCAT_" + std::to_string(_strcat) + "_CHECK");
-
-                add(asmTokens, OpCode::PUSHIDX, "STRCAT_" + std::to_string(_strcat) + "_FALSE");
-                add(asmTokens, OpCode::POPA);
-                add(asmTokens, OpCode::POPB);
-                add(asmTokens, OpCode::SUB);
-
-                add(asmTokens, OpCode::PUSHC);
-                add(asmTokens, OpCode::PUSHB, "STRCAT_" + std::to_string(_strcat) + "_SAVEIDX");
-            }
-        } else {
-            error(token, "Function `strcat': String value expected for parameter 2");
-        }
-
-        // A = LEN L, B = LEN R, C = L, IDX = R
-        add(asmTokens, OpCode::POPIDX);
-        add(asmTokens, OpCode::POPB);
-        add(asmTokens, OpCode::POPC);
-        add(asmTokens, OpCode::POPA);
-
-        // STACK = [L,R]
-        add(asmTokens, OpCode::PUSHIDX);
-        add(asmTokens, OpCode::PUSHC);
-
-        add(asmTokens, OpCode::ADD);
-        addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
-
-        add(asmTokens, OpCode::CALLOC);
-
-        // A = LEN L, B = LEN R, C = LEN N, IDX = N
-
-        add(asmTokens, OpCode::PUSHA);
-        // STACK = [LEN L,L,R]
-
-        add(asmTokens, OpCode::POPC);
-        // A = LEN L, B = LEN R, C = LEN L, IDX = N
-        // STACK = [L,R]
-
-        add(asmTokens, OpCode::POPA);
-        // A = L, B = LEN R, C = LEN L, IDX = N
-        // STACK = [R]
-
-        add(asmTokens, OpCode::PUSHB);
-        // STACK = [LEN R,R]
-
-        add(asmTokens, OpCode::PUSHA);
-        // STACK = [L, LEN R,R]
-
-        add(asmTokens, OpCode::POPB);
-        // A = L, B = L, C = LEN L, IDX = N
-        // STACK = [LEN R,R]
-
-        add(asmTokens, OpCode::PUSHIDX);
-        // STACK = [N,LEN R,R]
-
-        add(asmTokens, OpCode::POPA);
-        // A = N, B = L, C = LEN L, IDX = N
-        // STACK = [LEN R,R]
-
-        add(asmTokens, OpCode::COPY);
-
-        add(asmTokens, OpCode::PUSHC);
-        // STACK = [LEN L,LEN R,R]
-
-        add(asmTokens, OpCode::POPB);
-        // A = N, B = LEN L, C = LEN L, IDX = N
-        // STACK = [LEN R,R]
-
-        add(asmTokens, OpCode::ADD);
-        // A = N, B = LEN L, C = N+L, IDX = N
-
-        add(asmTokens, OpCode::PUSHC);
-        // STACK = [N+L,LEN R,R]
-
-        add(asmTokens, OpCode::POPA);
-        // A = N+L, B = LEN L, C = N+L, IDX = N
-        // STACK = [LEN R,R]
+                add(asmTokens, OpCode::CMP);
+                add(asmTokens, OpCode::JMPEZ, "STRCAT_" + std::to_string(_strcat) + "_FALSE");
+                addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                add(asmTokens, OpCode::JMP, "STRCAT_" + std::to_string(_strcat) + "_CHECK");
 
-        add(asmTokens, OpCode::POPC);
-        // A = N+L, B = LEN L, C = LEN R, IDX = N
-        // STACK = [R]
+                add(asmTokens, OpCode::PUSHIDX, "STRCAT_" + std::to_string(_strcat) + "_FALSE");
+                add(asmTokens, OpCode::POPA);
+                add(asmTokens, OpCode::POPB);
+                add(asmTokens, OpCode::SUB);
 
-        add(asmTokens, OpCode::POPB);
-        // A = N+L, B = R, C = LEN R, IDX = N
-        // STACK = []
+                add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::PUSHB, "STRCAT_" + std::to_string(_strcat) + "_SAVEIDX");
+            }
+        } else {
+            error(token, "Function `strcat': String value expected for parameter 2");
+        }
 
-        add(asmTokens, OpCode::COPY);
+        if (optimising) {
+            runtimeCall(asmTokens, "RUNTIME_STRCAT");
+        } else {
+            concatenate(asmTokens);
+        }
 
         add(asmTokens, OpCode::PUSHIDX);
         // STACK = [N]
 
-        return String();
+        String result;
+
+        if (optimising && llength && rlength)
+            result.length = *llength + *rlength;
+
+        return result;
     } else if (token.str == "strcmp") {
         auto ltype = expression(cpu, asmTokens, tokens, 0);
         check(tokens[current++], TokenType::COMMA, "`,' expected");
@@ -829,26 +1419,14 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
-        add(asmTokens, OpCode::PUSHA);
-        add(asmTokens, OpCode::POPIDX);
-
-        add(asmTokens, OpCode::EQ);
-        add(asmTokens, OpCode::NOT);
-        add(asmTokens, OpCode::JMPEZ, "STRCMP_" + std::to_string(_strcmp) + "_DONE");
-
-        add(asmTokens, OpCode::CMP, "STRCMP_" + std::to_string(_strcmp) + "_CMP");
-        add(asmTokens, OpCode::JMPNZ, "STRCMP_" + std::to_string(_strcmp) + "_DONE");
-
-        add(asmTokens, OpCode::IDXC);
-        add(asmTokens, OpCode::JMPEZ, "STRCMP_" + std::to_string(_strcmp) + "_DONE");
 
-        addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
-        addValue16(asmTokens, OpCode::INCA, Int16AsValue(1));
-        addValue16(asmTokens, OpCode::INCB, Int16AsValue(1));
-
-        add(asmTokens, OpCode::JMP, "STRCMP_" + std::to_string(_strcmp) + "_CMP");
-
-        add(asmTokens, OpCode::PUSHC, "STRCMP_" + std::to_string(_strcmp) + "_DONE");
+        if (optimising) {
+            add(asmTokens, OpCode::STRCMP);
+            add(asmTokens, OpCode::PUSHC);
+        } else {
+            compare(asmTokens, "STRCMP_" + std::to_string(_strcmp));
+            add(asmTokens, OpCode::PUSHC, "STRCMP_" + std::to_string(_strcmp) + "_DONE");
+        }
         return Integer;
     } else if (token.str == "strcpy") {
         auto type = expression(cpu, asmTokens, tokens, 0);
@@ -857,14 +1435,21 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(token, "Function `strcpy': Cannot assign a void value to parameter 1");
 
+        String result;
+
         if (std::holds_alternative<String>(type)) {
             auto _string = std::get<String>(type);
+            auto length = knownLength(_string);
+
+            if (optimising)
+                result.length = length;
 
             add(asmTokens, OpCode::POPIDX);
 
-            if (_string.literal.size()) {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(_string.literal.size()));
-                add(asmTokens, OpCode::PUSHC);
+            if (length) {
+                addValue16(asmTokens, OpCode::SETC, Int16AsValue(*length));
+            } else if (optimising) {
+                add(asmTokens, OpCode::STRLEN);
             } else {
                 static int STRCPYs = 1;
                 int _strcpy = STRCPYs++;
@@ -883,27 +1468,20 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
                 add(asmTokens, OpCode::POPA);
                 add(asmTokens, OpCode::POPB);
                 add(asmTokens, OpCode::SUB);
-
-                add(asmTokens, OpCode::PUSHC);
             }
 
-            addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
-
-            add(asmTokens, OpCode::PUSHIDX);
-            add(asmTokens, OpCode::POPB);
-            add(asmTokens, OpCode::CALLOC);
-            add(asmTokens, OpCode::PUSHIDX);
-            add(asmTokens, OpCode::POPA);
-            add(asmTokens, OpCode::POPC);
-
-            add(asmTokens, OpCode::COPY);
+            if (optimising) {
+                runtimeCall(asmTokens, "RUNTIME_STRCPY");
+            } else {
+                duplicate(asmTokens);
+            }
 
             add(asmTokens, OpCode::PUSHIDX);
         } else {
             error(tokens[current], "Function `strcpy': String value expected for parameter 1");
         }
 
-        return String();
+        return result;
     } else if (token.str == "strlen") {
         auto type = expression(cpu, asmTokens, tokens, 0);
         check(tokens[current], TokenType::RIGHT_PAREN, "`)' expected");
@@ -913,11 +1491,15 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
         if (std::holds_alternative<String>(type)) {
             auto _string = std::get<String>(type);
+            auto length = knownLength(_string);
 
             add(asmTokens, OpCode::POPIDX);
 
-            if (_string.literal.size()) {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(_string.literal.size()));
+            if (length) {
+                addValue16(asmTokens, OpCode::SETC, Int16AsValue(*length));
+                add(asmTokens, OpCode::PUSHC);
+            } else if (optimising) {
+                add(asmTokens, OpCode::STRLEN);
                 add(asmTokens, OpCode::PUSHC);
             } else {
                 static int STRLENs = 1;
@@ -968,28 +1550,11 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (len == None || len == Undefined)
             error(token, "Function `strcmp': Cannot assign a void value to parameter 3");
 
-        add(asmTokens, OpCode::POPC);
-        add(asmTokens, OpCode::PUSHC);
-
-        addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
-
-        add(asmTokens, OpCode::CALLOC);
-        add(asmTokens, OpCode::POPC);
-
-        add(asmTokens, OpCode::POPB);
-        add(asmTokens, OpCode::POPA);
-
-        add(asmTokens, OpCode::PUSHC);
-        add(asmTokens, OpCode::ADD);
-
-        add(asmTokens, OpCode::PUSHC);
-        add(asmTokens, OpCode::POPB);
-
-        add(asmTokens, OpCode::PUSHIDX);
-        add(asmTokens, OpCode::POPA);
-        add(asmTokens, OpCode::POPC);
-
-        add(asmTokens, OpCode::COPY);
+        if (optimising) {
+            runtimeCall(asmTokens, "RUNTIME_SUBSTR");
+        } else {
+            extract(asmTokens);
+        }
 
         add(asmTokens, OpCode::PUSHIDX);
 
@@ -1001,6 +1566,9 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         if (type == None || type == Undefined)
             error(tokens[current], "Function `tan': Cannot assign a void value to parameter 1");
 
+        if (foldUnary(OpCode::TAN))
+            return Float;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::TAN);
         add(asmTokens, OpCode::PUSHC);
@@ -1053,10 +1621,154 @@ static ValueType builtin(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
 static std::vector<std::pair<std::string, int32_t>> StringTable;
 
+// Under -O, while no string is written into, every literal with the same
+// text is the same string. The data section then writes each literal once,
+// and one that ends another longer literal points into it.
+static bool internStrings = false;
+static std::map<std::string, int32_t> interned;
+
+static void intern(const std::vector<Token> &tokens) {
+    std::vector<std::string> literals;
+
+    for (const auto &token : tokens) {
+        if (token.type == TokenType::STRING && std::find(literals.begin(), literals.end(), token.str) == literals.end())
+            literals.push_back(token.str);
+    }
+
+    std::stable_sort(literals.begin(), literals.end(), [](const std::string &a, const std::string &b) {
+        return a.size() > b.size();
+    });
+
+    for (const auto &literal : literals) {
+        auto longer = std::find_if(StringTable.begin(), StringTable.end(), [&](const std::pair<std::string, int32_t> &entry) {
+            return entry.first.compare(entry.first.size() - std::min(entry.first.size(), literal.size()), std::string::npos, literal) == 0;
+        });
+
+        if (longer != StringTable.end()) {
+            interned[literal] = longer->second + (int32_t)(longer->first.size() - literal.size());
+        } else {
+            auto ptr = env->defineString(literal);
+
+            StringTable.push_back(std::make_pair(literal, ptr));
+            interned[literal] = ptr;
+        }
+    }
+}
+
+// Opcodes whose argument is a slot in the current frame
+static bool framed(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::READA: case OpCode::READB: case OpCode::READC:
+        case OpCode::WRITEA: case OpCode::WRITEB: case OpCode::WRITEC:
+        case OpCode::MOVIDX:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Copies the body of `name' in place of a call. The callee's frame becomes a
+// block of temporaries in the caller's, the arguments are popped straight
+// into it and each RETURN jumps past the copy, leaving the result on the
+// stack as before.
+static void inlineCall(std::vector<AsmToken> &asmTokens, const std::string &name) {
+    static int INLINEs = 1;
+    auto suffix = "_INLINE_" + std::to_string(INLINEs++);
+    const auto &function = inlinable.at(name);
+    auto base = env->createTemporary(function.frame);
+
+    for (size_t i = 0; i < function.params; i++) {
+        add(asmTokens, OpCode::POPC);
+        addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(base+i));
+    }
+
+    spill(asmTokens);
+
+    for (auto token : function.body) {
+        if (token.label.size() && !runtime.count(token.label))
+            token.label += suffix;
+
+        if (token.opcode == OpCode::RETURN) {
+            token = AsmToken(OpCode::JMP).setLabel(name + "_RETURN" + suffix);
+        } else if (framed(token.opcode)) {
+            token.arg = Int16AsValue((int16_t)std::get<uint32_t>(*token.arg) + base);
+        }
+
+        asmTokens.push_back(token);
+    }
+
+    add(asmTokens, OpCode::NOP, name + "_RETURN" + suffix);
+}
+
+static int16_t integerLiteral(const Token &token) {
+    if (token.str.size() > 2 && (token.str[1] == 'x' || token.str[1] == 'X'))
+        return (int16_t)std::stoi(token.str, nullptr, 16);
+
+    if (token.str.size() > 2 && token.str[1] == 'b')
+        return (int16_t)std::stoi(token.str.substr(2), nullptr, 2);
+
+    return (int16_t)std::stoi(token.str);
+}
+
+// A function-local block belongs to its scope, which frees it or keeps it
+// in the frame, only when no use of its variable can copy the pointer. That
+// is known once every use has been compiled, so the blocks stay unowned
+// until a first pass has found the `var' of every candidate and of each one
+// that escapes.
+static std::set<size_t> candidates;
+static std::set<size_t> escaping;
+static bool owning = false;
+
+// Notes the use of the variable named at `at'. Indexing every dimension of
+// an array or taking a property of a struct stays inside the block; any
+// other use may copy the pointer, and lets the block the variable owns
+// escape.
+static void use(const std::vector<Token> &tokens, size_t at) {
+    auto type = env->getType(tokens[at].str);
+    size_t dimensions = 0;
+
+    while (std::holds_alternative<Array>(type)) {
+        type = std::get<Array>(type).getType();
+        dimensions++;
+    }
+
+    auto next = at+1;
+    size_t indices = 0;
+
+    while (next < tokens.size() && tokens[next].type == TokenType::LEFT_BRACKET) {
+        int nesting = 0;
+
+        do {
+            if (tokens[next].type == TokenType::LEFT_BRACKET) {
+                nesting++;
+            } else if (tokens[next].type == TokenType::RIGHT_BRACKET) {
+                nesting--;
+            }
+            next++;
+        } while (next < tokens.size() && nesting > 0);
+
+        indices++;
+    }
+
+    if (dimensions ? indices == dimensions : next < tokens.size() && tokens[next].type == TokenType::ACCESSOR)
+        return;
+
+    auto declared = env->disown(tokens[at].str);
+    if (declared)
+        escaping.insert(*declared);
+}
+
 static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
     auto token = tokens[current];
 
     if (token.type == TokenType::STRING) {
+        if (internStrings) {
+            addPointer(asmTokens, OpCode::SETIDX, interned.at(token.str));
+            add(asmTokens, OpCode::PUSHIDX);
+
+            return String(token.str);
+        }
+
         auto ptr = env->defineString(token.str);
 
         StringTable.push_back(std::make_pair(token.str, ptr));
@@ -1068,42 +1780,22 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
 
         return String(token.str);
     } else if (token.type == TokenType::CHARACTER) {
-        addValue16(asmTokens, OpCode::SETC, ByteAsValue((int8_t)token.str[0]));
-        add(asmTokens, OpCode::PUSHC);
+        pushOperand(asmTokens, AsmToken(OpCode::SETC, ByteAsValue((int8_t)token.str[0])));
         return Byte;
     } else if (token.type == TokenType::INTEGER) {
         auto integer_type = Integer;
-        if (token.str.size() > 2 && (token.str[1] == 'x' || token.str[1] == 'X')) {
-            int16_t value = (int16_t)std::stoi(token.str, nullptr, 16);
-            if (value < 256) {
-                addValue16(asmTokens, OpCode::SETC, ByteAsValue(value));
-                integer_type = Byte;
-            } else {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(value));
-            }
-        } else if (token.str.size() > 2 && token.str[1] == 'b') {
-            int16_t value = (int16_t)std::stoi(token.str.substr(2), nullptr, 2);
-            if (value < 256) {
-                addValue16(asmTokens, OpCode::SETC, ByteAsValue(value));
-                integer_type = Byte;
-            } else {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(value));
-            }
+        int16_t value = integerLiteral(token);
+
+        if (value < 256) {
+            pushOperand(asmTokens, AsmToken(OpCode::SETC, ByteAsValue(value)));
+            integer_type = Byte;
         } else {
-            int16_t value = (int16_t)std::stoi(token.str);
-            if (value < 256) {
-                addValue16(asmTokens, OpCode::SETC, ByteAsValue(value));
-                integer_type = Byte;
-            } else {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(value));
-            }
+            pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(value)));
         }
 
-        add(asmTokens, OpCode::PUSHC);
         return integer_type;
     } else if (token.type == TokenType::REAL) {
-        addFloat(asmTokens, OpCode::SETC, std::stof(token.str));
-        add(asmTokens, OpCode::PUSHC);
+        pushOperand(asmTokens, AsmToken(OpCode::SETC, std::stof(token.str)));
         return Float;
     } else if (token.type == TokenType::BUILTIN || token.type == TokenType::INT || token.type == TokenType::FLOAT) {
         return builtin(cpu, asmTokens, tokens);
@@ -1169,12 +1861,17 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
                 error(token, "Function `" + name + "' expected " + std::to_string(function.params.size()) + " arguments, got " + std::to_string(argcount));
             }
 
-            add(asmTokens, OpCode::CALL, name);
+            if (optimising && env->inFunction() && inlinable.count(name) && env->fits(inlinable.at(name).frame)) {
+                inlineCall(asmTokens, name);
+            } else {
+                add(asmTokens, OpCode::CALL, name);
+            }
 
             if (function.returnType == Any) {
                 for (const auto &param : param_types) {
                     if (param.second != None && param.second != Undefined && param.second != Any) {
-                        return param.second;
+                        // The first typed argument need not be the one returned
+                        return optimising ? withoutLength(param.second) : param.second;
                     }
                 }
             }
@@ -1188,7 +1885,7 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
             current++;
             check(tokens[current++], TokenType::LEFT_PAREN, "`(' expected");
 
-            addShort(asmTokens, OpCode::ALLOC, slots);
+            allocate(asmTokens, _struct);
             add(asmTokens, OpCode::PUSHIDX);
 
             size_t argcount = 0;
@@ -1216,11 +1913,21 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
                     }
                 }
 
-                add(asmTokens, OpCode::POPC);
-                add(asmTokens, OpCode::POPIDX);
-                add(asmTokens, OpCode::WRITECX);
+                if (pendingConstants(1)) {
+                    auto operand = operands.back();
+                    operands.pop_back();
 
-                addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                    add(asmTokens, OpCode::POPIDX);
+                    addData(asmTokens, operand);
+
+                    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                } else {
+                    add(asmTokens, OpCode::POPC);
+                    add(asmTokens, OpCode::POPIDX);
+                    add(asmTokens, OpCode::WRITECX);
+
+                    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                }
 
                 argcount++;
             }
@@ -1251,11 +1958,21 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
                     }
                 }
 
-                add(asmTokens, OpCode::POPC);
-                add(asmTokens, OpCode::POPIDX);
-                add(asmTokens, OpCode::WRITECX);
+                if (pendingConstants(1)) {
+                    auto operand = operands.back();
+                    operands.pop_back();
 
-                addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                    add(asmTokens, OpCode::POPIDX);
+                    addData(asmTokens, operand);
+
+                    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                } else {
+                    add(asmTokens, OpCode::POPC);
+                    add(asmTokens, OpCode::POPIDX);
+                    add(asmTokens, OpCode::WRITECX);
+
+                    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+                }
 
                 argcount++;
             }
@@ -1266,23 +1983,36 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
             }
 
             return ValueType(_struct);
+        } else if (optimising && env->getConstantValue(token.str)) {
+            auto value = *env->getConstantValue(token.str);
+
+            if (std::holds_alternative<float>(value)) {
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, std::get<float>(value)));
+            } else {
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, std::get<uint32_t>(value)));
+            }
+
+            return env->getType(token.str);
         } else if (env->isGlobal(token.str)) {
             auto type = env->getType(token.str);
 
             if (type == Undefined)
                 error(tokens[current], "Variable `" + token.str + "' used before initialisation");
 
-            addPointer(asmTokens, OpCode::LOADC, env->get(token.str));
-            add(asmTokens, OpCode::PUSHC);
-
             if (tokens[current+1].type == TokenType::DECREMENT) {
                 current++;
+                addPointer(asmTokens, OpCode::LOADC, env->get(token.str));
+                add(asmTokens, OpCode::PUSHC);
                 addValue16(asmTokens, OpCode::INCC, Int16AsValue(-1));
                 addPointer(asmTokens, OpCode::STOREC, env->get(token.str));
             } else if (tokens[current+1].type == TokenType::INCREMENT) {
                 current++;
+                addPointer(asmTokens, OpCode::LOADC, env->get(token.str));
+                add(asmTokens, OpCode::PUSHC);
                 addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
                 addPointer(asmTokens, OpCode::STOREC, env->get(token.str));
+            } else {
+                pushOperand(asmTokens, AsmToken(OpCode::LOADC, (int32_t)env->get(token.str)));
             }
 
             return type;
@@ -1292,18 +2022,22 @@ static ValueType TokenAsValue(int cpu, std::vector<AsmToken> &asmTokens, const s
             if (type == Undefined)
                 error(tokens[current], "Variable `" + token.str + "' used before initialisation");
 
-            addValue16(asmTokens, OpCode::READC, Int16AsValue(env->get(token.str)));
-
-            add(asmTokens, OpCode::PUSHC);
+            use(tokens, current);
 
             if (tokens[current+1].type == TokenType::DECREMENT) {
                 current++;
+                addValue16(asmTokens, OpCode::READC, Int16AsValue(env->get(token.str)));
+                add(asmTokens, OpCode::PUSHC);
                 addValue16(asmTokens, OpCode::INCC, Int16AsValue(-1));
                 addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->get(token.str)));
            } else if (tokens[current+1].type == TokenType::INCREMENT) {
                 current++;
+                addValue16(asmTokens, OpCode::READC, Int16AsValue(env->get(token.str)));
+                add(asmTokens, OpCode::PUSHC);
                 addValue16(asmTokens, OpCode::INCC, Int16AsValue(1));
                 addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->get(token.str)));
+            } else {
+                pushOperand(asmTokens, AsmToken(OpCode::READC, Int16AsValue(env->get(token.str))));
             }
 
             return type;
@@ -1421,6 +2155,10 @@ static ValueType prefix(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
         current++;
         auto type = prefix(cpu, asmTokens, tokens, rbp);
         checkTypeOrAny(tokens[current-1], type, Integer);
+
+        if (foldUnary(OpCode::BNOT))
+            return type;
+
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::BNOT);
         add(asmTokens, OpCode::PUSHC);
@@ -1431,7 +2169,7 @@ static ValueType prefix(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
 
         if (env->isStruct(name)) {
             auto _struct = env->getStruct(name);
-            addValue16(asmTokens, OpCode::SETC, Int16AsValue(_struct.size()));
+            pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(_struct.size())));
         } else if (env->isFunction(name)) {
             error(tokens[current], "Cannot pass function to sizeof");
         } else {
@@ -1440,24 +2178,23 @@ static ValueType prefix(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
             if (std::holds_alternative<Struct>(type)) {
                 auto _struct = std::get<Struct>(type);
 
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(_struct.size()));
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(_struct.size())));
             } else if (std::holds_alternative<Array>(type)) {
                 auto _array = std::get<Array>(type);
 
                 int len = _array.length ? _array.length : 1;
 
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(len));
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(len)));
             } else if (std::holds_alternative<String>(type)) {
                 auto _string = std::get<String>(type);
 
                 int len = _string.literal.size() ? _string.literal.size() : 1;
 
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(len));
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(len)));
             } else {
-                addValue16(asmTokens, OpCode::SETC, Int16AsValue(1));
+                pushOperand(asmTokens, AsmToken(OpCode::SETC, Int16AsValue(1)));
             }
         }
-        add(asmTokens, OpCode::PUSHC);
         return Integer;
     } else if (tokens[current].type == TokenType::PLUS) {
         current++;
@@ -1465,6 +2202,10 @@ static ValueType prefix(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
     } else if (tokens[current].type == TokenType::MINUS) {
         current++;
         auto type = prefix(cpu, asmTokens, tokens, rbp);
+
+        if (foldUnary(OpCode::SUB))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         addValue16(asmTokens, OpCode::SETA, Int16AsValue(0));
         add(asmTokens, OpCode::SUB);
@@ -1524,6 +2265,23 @@ static ValueType prefix(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
     } else if (tokens[current].type == TokenType::LEFT_BRACKET) {
         auto array = parseArray(cpu, asmTokens, tokens);
 
+        if (pendingConstants(array.size())) {
+            std::vector<AsmToken> elements(operands.end() - array.size(), operands.end());
+            operands.erase(operands.end() - array.size(), operands.end());
+
+            addShort(asmTokens, OpCode::ALLOC, array.size());
+            add(asmTokens, OpCode::PUSHIDX);
+
+            for (size_t i = 0; i < elements.size(); i++) {
+                if (i)
+                    addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(1));
+
+                addData(asmTokens, elements[i]);
+            }
+
+            return array;
+        }
+
         addShort(asmTokens, OpCode::ALLOC, array.size());
 
         addValue16(asmTokens, OpCode::INCIDX, Int16AsValue(array.size()));
@@ -1548,6 +2306,10 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
 
     if (token.type == TokenType::STAR) {
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
+
+        if (foldBinary(OpCode::MUL))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::MUL);
@@ -1555,6 +2317,10 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         return type;
     } else if (token.type == TokenType::SLASH) {
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
+
+        if (foldBinary(OpCode::DIV))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::DIV);
@@ -1562,6 +2328,10 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         return type;
     } else if (token.type == TokenType::PLUS) {
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
+
+        if (foldBinary(OpCode::ADD))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::ADD);
@@ -1569,6 +2339,10 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         return type;
     } else if (token.type == TokenType::MINUS) {
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
+
+        if (foldBinary(OpCode::SUB))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::SUB);
@@ -1576,6 +2350,10 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         return type;
     } else if (token.type == TokenType::PERCENT) {
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
+
+        if (foldBinary(OpCode::MOD))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::MOD);
@@ -1586,6 +2364,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::IDIV))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::IDIV);
@@ -1596,6 +2377,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::LSHIFT))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::LSHIFT);
@@ -1606,6 +2390,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::RSHIFT))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::RSHIFT);
@@ -1616,6 +2403,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::BAND))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::BAND);
@@ -1626,6 +2416,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::BOR))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::BOR);
@@ -1636,6 +2429,9 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
         checkTypeOrAny(tokens[current-1], type, {Integer, Byte});
 
+        if (foldBinary(OpCode::XOR))
+            return type;
+
         add(asmTokens, OpCode::POPB);
         add(asmTokens, OpCode::POPA);
         add(asmTokens, OpCode::XOR);
@@ -1650,16 +2446,20 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
             auto type = expression(cpu, asmTokens, tokens, 0);
             check(tokens[current++], TokenType::RIGHT_BRACKET, "`]' expected");
 
-            addValue16(asmTokens, OpCode::SETB, Int16AsValue(array.offset));
+            if (optimising) {
+                addIndex(asmTokens, array.offset, type);
+            } else {
+                addValue16(asmTokens, OpCode::SETB, Int16AsValue(array.offset));
 
-            add(asmTokens, OpCode::POPA);
-            add(asmTokens, OpCode::MUL);
-            add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::POPA);
+                add(asmTokens, OpCode::MUL);
+                add(asmTokens, OpCode::PUSHC);
 
-            add(asmTokens, OpCode::POPB);
-            add(asmTokens, OpCode::POPA);
-            add(asmTokens, OpCode::ADD);
-            add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::POPB);
+                add(asmTokens, OpCode::POPA);
+                add(asmTokens, OpCode::ADD);
+                add(asmTokens, OpCode::PUSHC);
+            }
 
             if (!std::holds_alternative<Array>(array.getType())) {
                 add(asmTokens, OpCode::POPIDX);
@@ -1775,7 +2575,11 @@ static ValueType Op(int cpu, std::vector<AsmToken> &asmTokens, const Token &lhs,
 
         add(asmTokens, OpCode::POPC);
         add(asmTokens, OpCode::JMPEZ, "AND_" + std::to_string(_and) + "_FALSE");
-        add(asmTokens, OpCode::PUSHC);
+
+        // The right operand replaces the left one, which must not stay
+        // behind on the stack
+        if (!optimising)
+            add(asmTokens, OpCode::PUSHC);
 
         auto type = expression(cpu, asmTokens, tokens, token.lbp);
 
@@ -1836,15 +2640,91 @@ static void define_const(int cpu, std::vector<AsmToken> &asmTokens, const std::v
     if (type != Byte && type != Integer && type != Float && !std::holds_alternative<String>(type))
         error(tokens[current], "Cannot assign a " + ValueTypeToString(type) + " value to constant value `" + name + "'");
 
+    std::optional<AsmToken> value;
+    if (pendingConstants(1))
+        value = operands.back();
+
     add(asmTokens, OpCode::POPC);
     if (env->inFunction()) {
         addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->createConstant(name, type)));
     } else {
         addPointer(asmTokens, OpCode::STOREC, env->createConstant(name, type));
     }
+
+    if (value) {
+        if (value->isFloat()) {
+            env->setConstantValue(name, std::get<float>(*value->arg));
+        } else {
+            env->setConstantValue(name, std::get<uint32_t>(*value->arg));
+        }
+    }
+}
+
+// Whether the declaration at `start' runs whenever its scope is left, so
+// the block it allocates can be owned by the scope. It may not after an
+// `if' or `else' without braces, or under a case label.
+static bool alwaysRuns(const std::vector<Token> &tokens, size_t start) {
+    auto before = start ? tokens[start-1].type : TokenType::LEFT_BRACE;
+
+    if (before != TokenType::LEFT_BRACE && before != TokenType::RIGHT_BRACE && before != TokenType::SEMICOLON)
+        return false;
+
+    int depth = 0;
+
+    for (size_t i = start; i-- > 0 && depth >= 0; ) {
+        if (tokens[i].type == TokenType::RIGHT_BRACE) {
+            depth++;
+        } else if (tokens[i].type == TokenType::LEFT_BRACE) {
+            depth--;
+        } else if (depth == 0 && (tokens[i].type == TokenType::CASE || tokens[i].type == TokenType::DEFAULT)) {
+            return false;
+        }
+    }
+
+    depth = 0;
+
+    for (size_t i = start; i < tokens.size() && depth >= 0; i++) {
+        if (tokens[i].type == TokenType::LEFT_BRACE) {
+            depth++;
+        } else if (tokens[i].type == TokenType::RIGHT_BRACE) {
+            depth--;
+        } else if (depth == 0 && (tokens[i].type == TokenType::CASE || tokens[i].type == TokenType::DEFAULT)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Whether the block allocated by the `var' at `declared' is owned by its
+// scope. Until the first pass is over every candidate is tracked, so its
+// uses can be seen, but none is owned.
+static bool owns(const std::vector<Token> &tokens, size_t declared) {
+    if (!alwaysRuns(tokens, declared) || escaping.count(declared))
+        return false;
+
+    candidates.insert(declared);
+    return true;
+}
+
+// Frees the blocks owned by each scope of the function from the current one
+// out to, but not including, `outer'
+static void release(std::vector<AsmToken> &asmTokens, std::shared_ptr<Environment> outer) {
+    if (!owning)
+        return;
+
+    for (auto scope = env; scope && scope != outer && scope->inFunction(); scope = scope->Parent()) {
+        for (const auto &block : scope->Owned()) {
+            addValue16(asmTokens, OpCode::READC, Int16AsValue(block.slot));
+            add(asmTokens, OpCode::MOVCIDX);
+            deallocate(asmTokens, block.type);
+        }
+    }
 }
 
 static void define_variable(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
+    auto declared = current;
+
     check(tokens[current++], TokenType::VAR, "`var' expected");
     auto name = identifier(tokens[current++]);
 
@@ -1908,11 +2788,26 @@ static void define_variable(int cpu, std::vector<AsmToken> &asmTokens, const std
         }
 
         if (env->inFunction()) {
-            addShort(asmTokens, OpCode::ALLOC, size);
+            auto slot = env->create(name, type);
+            auto owned = owns(tokens, declared);
+
+            // Under -O a block nothing else can reach goes in the frame
+            // instead, when the frame has room, which needs neither an
+            // allocation nor a free
+            if (optimising && owning && owned && env->fits(size)) {
+                addValue16(asmTokens, OpCode::MOVIDX, Int16AsValue(env->create(" " + name, type, size)));
+                owned = false;
+            } else {
+                addShort(asmTokens, OpCode::ALLOC, size);
+            }
+
             add(asmTokens, OpCode::PUSHIDX);
             add(asmTokens, OpCode::POPC);
 
-            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->create(name, type)));
+            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(slot));
+
+            if (owned)
+                env->own(slot, type, declared);
         } else {
             addShort(asmTokens, OpCode::ALLOC, size);
             addPointer(asmTokens, OpCode::SAVEIDX, env->create(name, type));
@@ -1921,14 +2816,24 @@ static void define_variable(int cpu, std::vector<AsmToken> &asmTokens, const std
         current++;
 
         if (env->inFunction()) {
+            auto constructed = tokens[current].type == TokenType::IDENTIFIER && env->isStruct(tokens[current].str);
+
             auto type = expression(cpu, asmTokens, tokens);
             check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
 
             if (type == None)
                 error(tokens[current], "Cannot assign a void value to variable `" + name + "'");
 
+            auto slot = env->create(name, settled(name, type));
+
             add(asmTokens, OpCode::POPC);
-            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->create(name, type)));
+            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(slot));
+
+            // Only a struct built right here is known to have no other pointer
+            constructed = constructed && std::holds_alternative<Struct>(type) && tokens[current-2].type == TokenType::RIGHT_PAREN;
+
+            if (constructed && owns(tokens, declared))
+                env->own(slot, type, declared);
         } else {
             auto type = expression(cpu, asmTokens, tokens);
             check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
@@ -1937,7 +2842,7 @@ static void define_variable(int cpu, std::vector<AsmToken> &asmTokens, const std
                 error(tokens[current], "Cannot assign a void value to variable `" + name + "'");
 
             add(asmTokens, OpCode::POPC);
-            addPointer(asmTokens, OpCode::STOREC, env->create(name, type));
+            addPointer(asmTokens, OpCode::STOREC, env->create(name, settled(name, type)));
         }
     } else {
 
@@ -1947,6 +2852,138 @@ static void define_variable(int cpu, std::vector<AsmToken> &asmTokens, const std
 static ValueType statement(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens);
 static ValueType declaration(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens);
 
+// Conditions of if, while and for are compiled as branches under -O. The
+// condition is split at && and || first, so each operand can jump straight
+// to where the whole condition is decided and ! only swaps the sense of the
+// jump. No boolean is ever pushed.
+struct Condition {
+    enum Kind { TEST, NOT, AND, OR } kind;
+    size_t start, end;
+    std::vector<Condition> operands;
+};
+
+static size_t closing(const std::vector<Token> &tokens, size_t open) {
+    int depth = 0;
+
+    for (size_t i = open; i < tokens.size(); i++) {
+        if (tokens[i].type == TokenType::LEFT_PAREN || tokens[i].type == TokenType::LEFT_BRACKET) {
+            depth++;
+        } else if (tokens[i].type == TokenType::RIGHT_PAREN || tokens[i].type == TokenType::RIGHT_BRACKET) {
+            if (--depth == 0)
+                return i;
+        }
+    }
+
+    error(tokens[open], "`)' expected");
+    return tokens.size();
+}
+
+// Whether tokens `start' to `end' are a single operand of a !, i.e. one
+// token, a bracketed expression or another !
+static bool isNegatable(const std::vector<Token> &tokens, size_t start, size_t end) {
+    if (start + 1 == end)
+        return true;
+
+    if (tokens[start].type == TokenType::LEFT_PAREN)
+        return closing(tokens, start) + 1 == end;
+
+    if (tokens[start].type == TokenType::NOT)
+        return isNegatable(tokens, start+1, end);
+
+    return false;
+}
+
+static Condition parseCondition(const std::vector<Token> &tokens, size_t start, size_t end) {
+    for (auto join : { TokenType::OR, TokenType::AND }) {
+        Condition condition{ join == TokenType::OR ? Condition::OR : Condition::AND, start, end, {} };
+        size_t from = start;
+
+        for (size_t i = start; i < end; i++) {
+            if (tokens[i].type == TokenType::LEFT_PAREN || tokens[i].type == TokenType::LEFT_BRACKET) {
+                i = closing(tokens, i);
+            } else if (tokens[i].type == join) {
+                condition.operands.push_back(parseCondition(tokens, from, i));
+                from = i+1;
+            }
+        }
+
+        if (condition.operands.size()) {
+            condition.operands.push_back(parseCondition(tokens, from, end));
+            return condition;
+        }
+    }
+
+    if (tokens[start].type == TokenType::NOT && isNegatable(tokens, start+1, end))
+        return Condition{ Condition::NOT, start, end, { parseCondition(tokens, start+1, end) } };
+
+    if (tokens[start].type == TokenType::LEFT_PAREN && closing(tokens, start) + 1 == end)
+        return parseCondition(tokens, start+1, end-1);
+
+    return Condition{ Condition::TEST, start, end, {} };
+}
+
+// Jumps to `label' when the condition is `sense' and falls through when not
+static void branch(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, const Condition &condition, const std::string &label, bool sense) {
+    static int BRANCHs = 1;
+
+    if (condition.kind == Condition::NOT) {
+        branch(cpu, asmTokens, tokens, condition.operands[0], label, !sense);
+    } else if (condition.kind == Condition::AND || condition.kind == Condition::OR) {
+        // An && that is true or an || that is false is only decided by its
+        // last operand, so the others skip past it
+        bool decided = (condition.kind == Condition::OR) == sense;
+        auto skip = "BRANCH_" + std::to_string(BRANCHs++) + "_SKIP";
+
+        for (size_t i = 0; i < condition.operands.size(); i++) {
+            if (decided || i + 1 == condition.operands.size()) {
+                branch(cpu, asmTokens, tokens, condition.operands[i], label, sense);
+            } else {
+                branch(cpu, asmTokens, tokens, condition.operands[i], skip, !sense);
+            }
+        }
+
+        if (!decided)
+            add(asmTokens, OpCode::NOP, skip);
+    } else {
+        current = condition.start;
+
+        auto type = expression(cpu, asmTokens, tokens, Precedence::AND);
+
+        if (current != condition.end)
+            error(tokens[current], "Unexpected `" + tokens[current].str + "' in condition");
+
+        if (type == None)
+            error(tokens[current], "Cannot test a void value");
+
+        if (pendingConstants(1)) {
+            auto operand = operands.back();
+            bool truth = operand.isFloat() ? floatConstant(operand) != 0 : integerConstant(operand) != 0;
+
+            operands.pop_back();
+
+            if (truth == sense)
+                add(asmTokens, OpCode::JMP, label);
+
+            return;
+        }
+
+        add(asmTokens, OpCode::POPC);
+        add(asmTokens, sense ? OpCode::JMPNZ : OpCode::JMPEZ, label);
+    }
+}
+
+// Compiles the condition that runs up to `end' as a branch
+static void branch(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, size_t end, const std::string &label, bool sense) {
+    if (current == end)
+        error(tokens[current], "Expression expected");
+
+    auto condition = parseCondition(tokens, current, end);
+
+    branch(cpu, asmTokens, tokens, condition, label, sense);
+
+    current = end;
+}
+
 static void if_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
     static int IFs = 1;
     int _if = IFs++;
@@ -1954,11 +2991,16 @@ static void if_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
     check(tokens[current++], TokenType::IF, "`if' expected");
     check(tokens[current++], TokenType::LEFT_PAREN, "`(' expected");
 
-    auto type = expression(cpu, asmTokens, tokens);
-    check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
+    if (optimising) {
+        branch(cpu, asmTokens, tokens, closing(tokens, current-1), "IF_" + std::to_string(_if) + "_FALSE", false);
+        check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
+    } else {
+        auto type = expression(cpu, asmTokens, tokens);
+        check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
 
-    add(asmTokens, OpCode::POPC);
-    add(asmTokens, OpCode::JMPEZ, "IF_" + std::to_string(_if) + "_FALSE");
+        add(asmTokens, OpCode::POPC);
+        add(asmTokens, OpCode::JMPEZ, "IF_" + std::to_string(_if) + "_FALSE");
+    }
 
     declaration(cpu, asmTokens, tokens);
 
@@ -1976,6 +3018,89 @@ static void if_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::ve
 static std::string LOOP_BREAK = "";
 static std::string LOOP_CONTINUE = "";
 
+// The scopes that break and continue leave into
+static std::shared_ptr<Environment> LOOP_BREAK_SCOPE;
+static std::shared_ptr<Environment> LOOP_CONTINUE_SCOPE;
+
+// Hoisted and reused values live in temporaries that are only needed until
+// the loop exits or the block ends. When no slot is left the value is simply
+// computed again.
+static std::optional<std::pair<AsmToken, AsmToken>> temporary() {
+    if (!env->fits(1))
+        return std::nullopt;
+
+    auto slot = env->createTemporary();
+
+    if (env->inFunction())
+        return std::make_pair(AsmToken(OpCode::WRITEC, Int16AsValue(slot)), AsmToken(OpCode::READC, Int16AsValue(slot)));
+
+    return std::make_pair(AsmToken(OpCode::STOREC, (int32_t)slot), AsmToken(OpCode::LOADC, (int32_t)slot));
+}
+
+// Moves the invariant computations of the loop entered by the jump at
+// `entry' in front of that jump, where they run once.
+static void hoist(std::vector<AsmToken> &asmTokens, size_t entry) {
+    std::vector<AsmToken> loop(asmTokens.begin()+entry+1, asmTokens.end());
+    auto preheader = hoistInvariants(loop, temporary);
+
+    asmTokens.erase(asmTokens.begin()+entry+1, asmTokens.end());
+    asmTokens.insert(asmTokens.begin()+entry, preheader.begin(), preheader.end());
+    asmTokens.insert(asmTokens.end(), loop.begin(), loop.end());
+}
+
+// Lets each block of the code from `start' reuse the values it has already
+// computed. Inside a function the frame and the globals are apart.
+static void reuse(std::vector<AsmToken> &asmTokens, size_t start) {
+    std::vector<AsmToken> code(asmTokens.begin()+start, asmTokens.end());
+
+    numberValues(code, env->inFunction(), temporary);
+
+    asmTokens.erase(asmTokens.begin()+start, asmTokens.end());
+    asmTokens.insert(asmTokens.end(), code.begin(), code.end());
+}
+
+// Rotated loops test the condition at the bottom, so each iteration takes a
+// single conditional branch back to the body. The condition (and the for
+// loop's post statement) is compiled into its own stream first and appended
+// after the body.
+static void rotated_while_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, int _while) {
+    std::vector<AsmToken> condition;
+
+    spill(asmTokens);
+
+    add(condition, OpCode::NOP, "WHILE_" + std::to_string(_while) + "_CHECK");
+    branch(cpu, condition, tokens, closing(tokens, current-1), "WHILE_" + std::to_string(_while) + "_BODY", true);
+    check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
+
+    auto entry = asmTokens.size();
+
+    add(asmTokens, OpCode::JMP, "WHILE_" + std::to_string(_while) + "_CHECK");
+    add(asmTokens, OpCode::NOP, "WHILE_" + std::to_string(_while) + "_BODY");
+
+    auto old_break = LOOP_BREAK;
+    auto old_continue = LOOP_CONTINUE;
+    auto old_break_scope = LOOP_BREAK_SCOPE;
+    auto old_continue_scope = LOOP_CONTINUE_SCOPE;
+
+    LOOP_BREAK = "WHILE_" + std::to_string(_while) + "_FALSE";
+    LOOP_CONTINUE = "WHILE_" + std::to_string(_while) + "_CHECK";
+    LOOP_BREAK_SCOPE = env;
+    LOOP_CONTINUE_SCOPE = env;
+
+    declaration(cpu, asmTokens, tokens);
+
+    LOOP_BREAK = old_break;
+    LOOP_CONTINUE = old_continue;
+    LOOP_BREAK_SCOPE = old_break_scope;
+    LOOP_CONTINUE_SCOPE = old_continue_scope;
+
+    asmTokens.insert(asmTokens.end(), condition.begin(), condition.end());
+
+    hoist(asmTokens, entry);
+
+    add(asmTokens, OpCode::NOP, "WHILE_" + std::to_string(_while) + "_FALSE");
+}
+
 static void while_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
     static int WHILEs = 1;
     int _while = WHILEs++;
@@ -1983,6 +3108,11 @@ static void while_statment(int cpu, std::vector<AsmToken> &asmTokens, const std:
     check(tokens[current++], TokenType::WHILE, "`while' expected");
     check(tokens[current++], TokenType::LEFT_PAREN, "`(' expected");
 
+    if (optimising) {
+        rotated_while_statment(cpu, asmTokens, tokens, _while);
+        return;
+    }
+
     add(asmTokens, OpCode::NOP, "WHILE_" + std::to_string(_while) + "_CHECK");
     auto type = expression(cpu, asmTokens, tokens);
     check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
@@ -1992,20 +3122,78 @@ static void while_statment(int cpu, std::vector<AsmToken> &asmTokens, const std:
 
     auto old_break = LOOP_BREAK;
     auto old_continue = LOOP_CONTINUE;
+    auto old_break_scope = LOOP_BREAK_SCOPE;
+    auto old_continue_scope = LOOP_CONTINUE_SCOPE;
 
     LOOP_BREAK = "WHILE_" + std::to_string(_while) + "_FALSE";
     LOOP_CONTINUE = "WHILE_" + std::to_string(_while) + "_CHECK";
+    LOOP_BREAK_SCOPE = env;
+    LOOP_CONTINUE_SCOPE = env;
 
     declaration(cpu, asmTokens, tokens);
 
     LOOP_BREAK = old_break;
     LOOP_CONTINUE = old_continue;
+    LOOP_BREAK_SCOPE = old_break_scope;
+    LOOP_CONTINUE_SCOPE = old_continue_scope;
 
     add(asmTokens, OpCode::JMP, "WHILE_" + std::to_string(_while) + "_CHECK");
 
     add(asmTokens, OpCode::NOP, "WHILE_" + std::to_string(_while) + "_FALSE");
 }
 
+static void rotated_for_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, int _for) {
+    std::vector<AsmToken> condition;
+    std::vector<AsmToken> post;
+
+    spill(asmTokens);
+
+    auto end = current;
+    while (end < tokens.size() && tokens[end].type != TokenType::SEMICOLON) {
+        if (tokens[end].type == TokenType::LEFT_PAREN || tokens[end].type == TokenType::LEFT_BRACKET)
+            end = closing(tokens, end);
+        end++;
+    }
+
+    add(condition, OpCode::NOP, "FOR_" + std::to_string(_for) + "_CHECK");
+    branch(cpu, condition, tokens, end, "FOR_" + std::to_string(_for) + "_BODY", true);
+    check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
+
+    add(post, OpCode::NOP, "FOR_" + std::to_string(_for) + "_POST");
+    statement(cpu, post, tokens);
+    spill(post);
+    check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
+
+    auto entry = asmTokens.size();
+
+    add(asmTokens, OpCode::JMP, "FOR_" + std::to_string(_for) + "_CHECK");
+    add(asmTokens, OpCode::NOP, "FOR_" + std::to_string(_for) + "_BODY");
+
+    auto old_break = LOOP_BREAK;
+    auto old_continue = LOOP_CONTINUE;
+    auto old_break_scope = LOOP_BREAK_SCOPE;
+    auto old_continue_scope = LOOP_CONTINUE_SCOPE;
+
+    LOOP_BREAK = "FOR_" + std::to_string(_for) + "_FALSE";
+    LOOP_CONTINUE = "FOR_" + std::to_string(_for) + "_CHECK";
+    LOOP_BREAK_SCOPE = env;
+    LOOP_CONTINUE_SCOPE = env;
+
+    declaration(cpu, asmTokens, tokens);
+
+    LOOP_BREAK = old_break;
+    LOOP_CONTINUE = old_continue;
+    LOOP_BREAK_SCOPE = old_break_scope;
+    LOOP_CONTINUE_SCOPE = old_continue_scope;
+
+    asmTokens.insert(asmTokens.end(), post.begin(), post.end());
+    asmTokens.insert(asmTokens.end(), condition.begin(), condition.end());
+
+    hoist(asmTokens, entry);
+
+    add(asmTokens, OpCode::NOP, "FOR_" + std::to_string(_for) + "_FALSE");
+}
+
 static void for_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
     static int FORs = 1;
     int _for = FORs++;
@@ -2020,6 +3208,11 @@ static void for_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::v
         declaration(cpu, asmTokens, tokens);
     }
 
+    if (optimising) {
+        rotated_for_statment(cpu, asmTokens, tokens, _for);
+        return;
+    }
+
     add(asmTokens, OpCode::NOP, "FOR_" + std::to_string(_for) + "_CHECK");
     expression(cpu, asmTokens, tokens);
     add(asmTokens, OpCode::POPC);
@@ -2034,21 +3227,193 @@ static void for_statment(int cpu, std::vector<AsmToken> &asmTokens, const std::v
 
     auto old_break = LOOP_BREAK;
     auto old_continue = LOOP_CONTINUE;
+    auto old_break_scope = LOOP_BREAK_SCOPE;
+    auto old_continue_scope = LOOP_CONTINUE_SCOPE;
 
     LOOP_BREAK = "FOR_" + std::to_string(_for) + "_FALSE";
     LOOP_CONTINUE = "FOR_" + std::to_string(_for) + "_CHECK";
+    LOOP_BREAK_SCOPE = env;
+    LOOP_CONTINUE_SCOPE = env;
 
     add(asmTokens, OpCode::NOP, "FOR_" + std::to_string(_for) + "_BODY");
     declaration(cpu, asmTokens, tokens);
 
     LOOP_BREAK = old_break;
     LOOP_CONTINUE = old_continue;
+    LOOP_BREAK_SCOPE = old_break_scope;
+    LOOP_CONTINUE_SCOPE = old_continue_scope;
 
     add(asmTokens, OpCode::JMP, "FOR_" + std::to_string(_for) + "_POST");
 
     add(asmTokens, OpCode::NOP, "FOR_" + std::to_string(_for) + "_FALSE");
 }
 
+// Case values as they are written: an integer, possibly negative, or a
+// character
+static int32_t caseValue(const std::vector<Token> &tokens) {
+    bool negative = false;
+
+    if (tokens[current].type == TokenType::MINUS) {
+        negative = true;
+        current++;
+    }
+
+    auto token = tokens[current++];
+
+    if (token.type == TokenType::INTEGER)
+        return negative ? -integerLiteral(token) : integerLiteral(token);
+
+    if (token.type == TokenType::CHARACTER && !negative)
+        return (int8_t)token.str[0];
+
+    error(token, "Integer constant expected");
+    return 0;
+}
+
+// Compares the value in A against the sorted cases from `lo' to `hi',
+// halving the range each time, until at most a few remain to be tested in
+// turn.
+static void searchCases(std::vector<AsmToken> &asmTokens, const std::vector<std::pair<int32_t, std::string>> &cases, size_t lo, size_t hi, const std::string &otherwise) {
+    static int SEARCHs = 1;
+
+    if (hi - lo <= 3) {
+        for (size_t i = lo; i < hi; i++) {
+            addValue16(asmTokens, OpCode::SETB, Int16AsValue(cases[i].first));
+            add(asmTokens, OpCode::JMPEQ, cases[i].second);
+        }
+
+        add(asmTokens, OpCode::JMP, otherwise);
+        return;
+    }
+
+    auto mid = lo + (hi - lo) / 2;
+    auto lower = "SWITCH_SEARCH_" + std::to_string(SEARCHs++) + "_LOWER";
+
+    addValue16(asmTokens, OpCode::SETB, Int16AsValue(cases[mid].first));
+    add(asmTokens, OpCode::JMPEQ, cases[mid].second);
+    add(asmTokens, OpCode::JMPLT, lower);
+
+    searchCases(asmTokens, cases, mid+1, hi, otherwise);
+
+    add(asmTokens, OpCode::NOP, lower);
+    searchCases(asmTokens, cases, lo, mid, otherwise);
+}
+
+// The body is compiled first, into its own stream, so that the dispatch in
+// front of it can be chosen from all the case values. Cases that fill at
+// least half of their range jump through a table indexed by the value, any
+// others are found by binary search. Cases fall through as in C, and break
+// leaves the switch.
+static void switch_statement(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens) {
+    static int SWITCHs = 1;
+    int _switch = SWITCHs++;
+    auto prefix = "SWITCH_" + std::to_string(_switch);
+
+    const size_t MinTable = 6;
+    const int32_t MaxTable = 256;
+
+    check(tokens[current++], TokenType::SWITCH, "`switch' expected");
+    check(tokens[current++], TokenType::LEFT_PAREN, "`(' expected");
+
+    auto type = expression(cpu, asmTokens, tokens);
+    check(tokens[current++], TokenType::RIGHT_PAREN, "`)' expected");
+
+    if (type == None || type == Undefined)
+        error(tokens[current-1], "Cannot switch on a void value");
+
+    checkTypeOrAny(tokens[current-1], type, { Integer, Byte });
+
+    add(asmTokens, OpCode::POPA);
+    spill(asmTokens);
+
+    check(tokens[current++], TokenType::LEFT_BRACE, "`{' expected");
+
+    std::vector<AsmToken> body;
+    std::vector<std::pair<int32_t, std::string>> cases;
+    std::string otherwise = prefix + "_END";
+
+    auto old_break = LOOP_BREAK;
+    auto old_break_scope = LOOP_BREAK_SCOPE;
+    LOOP_BREAK = prefix + "_END";
+    LOOP_BREAK_SCOPE = env;
+
+    env = env->beginScope(env);
+
+    while (tokens[current].type != TokenType::RIGHT_BRACE) {
+        if (tokens[current].type == TokenType::CASE) {
+            current++;
+
+            auto value = caseValue(tokens);
+            auto label = prefix + "_CASE_" + std::to_string(cases.size()+1);
+
+            check(tokens[current++], TokenType::COLON, "`:' expected");
+
+            for (const auto &_case : cases) {
+                if (_case.first == value)
+                    error(tokens[current-2], "Duplicate case " + std::to_string(value));
+            }
+
+            cases.push_back(std::make_pair(value, label));
+            add(body, OpCode::NOP, label);
+        } else if (tokens[current].type == TokenType::DEFAULT) {
+            current++;
+            check(tokens[current++], TokenType::COLON, "`:' expected");
+
+            if (otherwise != prefix + "_END")
+                error(tokens[current-2], "Duplicate default");
+
+            otherwise = prefix + "_DEFAULT";
+            add(body, OpCode::NOP, otherwise);
+        } else if (cases.empty() && otherwise == prefix + "_END") {
+            error(tokens[current], "`case' expected");
+        } else {
+            declaration(cpu, body, tokens);
+        }
+    }
+
+    check(tokens[current++], TokenType::RIGHT_BRACE, "`}' expected");
+
+    env = env->endScope();
+
+    LOOP_BREAK = old_break;
+    LOOP_BREAK_SCOPE = old_break_scope;
+
+    spill(body);
+
+    std::sort(cases.begin(), cases.end());
+
+    auto range = cases.size() ? (int64_t)cases.back().first - cases.front().first + 1 : 0;
+
+    if (cases.size() >= MinTable && range <= MaxTable && range <= 2 * (int64_t)cases.size()) {
+        auto low = cases.front().first;
+        auto high = cases.back().first;
+
+        addValue16(asmTokens, OpCode::SETB, Int16AsValue(high));
+        add(asmTokens, OpCode::JMPGT, otherwise);
+        addValue16(asmTokens, OpCode::SETB, Int16AsValue(low));
+        add(asmTokens, OpCode::JMPLT, otherwise);
+        add(asmTokens, OpCode::SUB);
+
+        addShort(asmTokens, OpCode::JMPIDX, range);
+
+        auto _case = cases.begin();
+        for (int32_t value = low; value <= high; value++) {
+            if (_case->first == value) {
+                add(asmTokens, OpCode::JMP, _case->second);
+                _case++;
+            } else {
+                add(asmTokens, OpCode::JMP, otherwise);
+            }
+        }
+    } else {
+        searchCases(asmTokens, cases, 0, cases.size(), otherwise);
+    }
+
+    asmTokens.insert(asmTokens.end(), body.begin(), body.end());
+
+    add(asmTokens, OpCode::NOP, prefix + "_END");
+}
+
 static ValueType parseIndexStatement(int cpu, std::vector<AsmToken> &asmTokens, const std::vector<Token> &tokens, ValueType containerType) {
     if (tokens[current].type == TokenType::LEFT_BRACKET) {
         current++;
@@ -2057,21 +3422,26 @@ static ValueType parseIndexStatement(int cpu, std::vector<AsmToken> &asmTokens,
             auto array = std::get<Array>(containerType);
             auto subType = array.getType();
 
-            addValue16(asmTokens, OpCode::SETB, Int16AsValue(array.offset));
+            if (!optimising)
+                addValue16(asmTokens, OpCode::SETB, Int16AsValue(array.offset));
 
             auto index_type = expression(cpu, asmTokens, tokens);
             if (index_type != Integer && index_type != Byte)
                 error(tokens[current], "Integer value expected");
 
-            add(asmTokens, OpCode::POPA);
-            add(asmTokens, OpCode::MUL);
-            add(asmTokens, OpCode::PUSHC);
+            if (optimising) {
+                addIndex(asmTokens, array.offset, index_type);
+            } else {
+                add(asmTokens, OpCode::POPA);
+                add(asmTokens, OpCode::MUL);
+                add(asmTokens, OpCode::PUSHC);
 
-            add(asmTokens, OpCode::POPB);
-            add(asmTokens, OpCode::POPA);
-            add(asmTokens, OpCode::ADD);
+                add(asmTokens, OpCode::POPB);
+                add(asmTokens, OpCode::POPA);
+                add(asmTokens, OpCode::ADD);
 
-            add(asmTokens, OpCode::PUSHC);
+                add(asmTokens, OpCode::PUSHC);
+            }
 
             check(tokens[current++], TokenType::RIGHT_BRACKET, "`]' expected");
 
@@ -2088,6 +3458,8 @@ static ValueType parseIndexStatement(int cpu, std::vector<AsmToken> &asmTokens,
         } else if (std::holds_alternative<String>(containerType)) {
             auto _string = std::get<String>(containerType);
 
+            stringsModified = true;
+
             auto index_type = expression(cpu, asmTokens, tokens);
             if (index_type != Integer && index_type != Byte)
                 error(tokens[current], "Integer value expected");
@@ -2157,6 +3529,7 @@ static void assign_op_statement(int cpu, std::vector<AsmToken> &asmTokens, const
 
         addPointer(asmTokens, OpCode::STOREC, env->set(varname, type));
     } else {
+        use(tokens, current);
         current += 2;
 
         auto type = expression(cpu, asmTokens, tokens);
@@ -2202,10 +3575,11 @@ static ValueType statement(int cpu, std::vector<AsmToken> &asmTokens, const std:
             auto type = expression(cpu, asmTokens, tokens);
 
             add(asmTokens, OpCode::POPC);
-            addPointer(asmTokens, OpCode::STOREC, env->set(varname, type));
+            addPointer(asmTokens, OpCode::STOREC, env->set(varname, settled(varname, type)));
 
             return type;
         } else {
+            use(tokens, current);
             current += 2;
 
             auto type = expression(cpu, asmTokens, tokens);
@@ -2215,7 +3589,7 @@ static ValueType statement(int cpu, std::vector<AsmToken> &asmTokens, const std:
 
             add(asmTokens, OpCode::POPC);
 
-            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->set(varname, type)));
+            addValue16(asmTokens, OpCode::WRITEC, Int16AsValue(env->set(varname, settled(varname, type))));
 
             return type;
         }
@@ -2254,6 +3628,7 @@ static ValueType statement(int cpu, std::vector<AsmToken> &asmTokens, const std:
             if (env->isGlobal(varname)) {
                 addPointer(asmTokens, OpCode::LOADC, env->get(varname));
             } else {
+                use(tokens, current-1);
                 addValue16(asmTokens, OpCode::READC, Int16AsValue(env->get(varname)));
             }
 
@@ -2336,16 +3711,20 @@ static ValueType declaration(int cpu, std::vector<AsmToken> &asmTokens, const st
         while_statment(cpu, asmTokens, tokens);
     } else if (tokens[current].type == TokenType::FOR) {
         for_statment(cpu, asmTokens, tokens);
+    } else if (tokens[current].type == TokenType::SWITCH) {
+        switch_statement(cpu, asmTokens, tokens);
     } else if (tokens[current].type == TokenType::BREAK) {
         current++;
         if (LOOP_BREAK.size() == 0)
             error(tokens[current], "Cannot break when not in loop");
+        release(asmTokens, LOOP_BREAK_SCOPE);
         add(asmTokens, OpCode::JMP, LOOP_BREAK);
         check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
     } else if (tokens[current].type == TokenType::CONTINUE) {
         current++;
         if (LOOP_CONTINUE.size() == 0)
             error(tokens[current], "Cannot continue when not in loop");
+        release(asmTokens, LOOP_CONTINUE_SCOPE);
         add(asmTokens, OpCode::JMP, LOOP_CONTINUE);
         check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
     } else if (tokens[current].type == TokenType::LEFT_BRACE) {
@@ -2355,6 +3734,7 @@ static ValueType declaration(int cpu, std::vector<AsmToken> &asmTokens, const st
             auto type = declaration(cpu, asmTokens, tokens);
         }
         check(tokens[current++], TokenType::RIGHT_BRACE, "`}' expected");
+        release(asmTokens, env->Parent());
         env = env->endScope();
     } else if (tokens[current].type == TokenType::RETURN) {
         if (!env->inFunction()) {
@@ -2367,7 +3747,22 @@ static ValueType declaration(int cpu, std::vector<AsmToken> &asmTokens, const st
             type = expression(cpu, asmTokens, tokens);
         }
         check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
-        add(asmTokens, OpCode::RETURN);
+
+        auto tail = optimising && operands.empty() && asmTokens.size() && asmTokens.back().opcode == OpCode::CALL;
+        auto end = asmTokens.size();
+
+        release(asmTokens, nullptr);
+
+        // A call in tail position jumps to the callee instead, which then
+        // reuses this frame: its prologue pops the arguments over ours and
+        // its RETURN goes straight back to our caller. Not when blocks are
+        // freed after the call.
+        if (tail && asmTokens.size() == end) {
+            asmTokens.back().opcode = OpCode::JMP;
+        } else {
+            add(asmTokens, OpCode::RETURN);
+        }
+
         return type;
     } else {
         statement(cpu, asmTokens, tokens);
@@ -2550,6 +3945,8 @@ static void define_function(int cpu, std::vector<AsmToken> &asmTokens, const std
     add(asmTokens, OpCode::NOP, name);
     env = env->beginScope(name, env);
 
+    functionLabels.push_back(std::make_pair(name, name + "_END"));
+
     auto rargs = params;
     std::reverse(rargs.begin(), rargs.end());
 
@@ -2562,6 +3959,9 @@ static void define_function(int cpu, std::vector<AsmToken> &asmTokens, const std
         env->create(rargs[i].first, rargs[i].second);
     }
 
+    auto body = asmTokens.size();
+    auto start = current;
+
     check(tokens[current++], TokenType::LEFT_BRACE, "`{' expected");
 
     ValueType type = SimpleType::NONE;
@@ -2577,8 +3977,24 @@ static void define_function(int cpu, std::vector<AsmToken> &asmTokens, const std
 
     check(tokens[current++], TokenType::RIGHT_BRACE, "`}' expected");
 
+    release(asmTokens, nullptr);
+
+    if (optimising)
+        reuse(asmTokens, body);
+
+    auto frame = env->frameSize();
+
     env = env->endScope();
 
+    // Only the first return statement gives the function its type, so a
+    // length holds only when there is no other
+    auto returns = std::count_if(tokens.begin()+start, tokens.begin()+current, [](const Token &token) {
+        return token.type == TokenType::RETURN;
+    });
+
+    if (returns != 1)
+        type = withoutLength(type);
+
     function.returnType = type;
     if (function.returnType == Any) {
         warning(tokens[current], "Function " + name + " is returning an unbound value");
@@ -2587,6 +4003,27 @@ static void define_function(int cpu, std::vector<AsmToken> &asmTokens, const std
     env->updateFunction(name, function);
 
     add(asmTokens, OpCode::RETURN);
+
+    if (optimising) {
+        std::vector<AsmToken> code(asmTokens.begin()+body, asmTokens.end());
+        std::set<std::string> labels;
+
+        for (const auto &token : code) {
+            if (token.label.size() && OpCodeDefinition[OpCodeAsString(token.opcode)].second != ArgType::LABEL)
+                labels.insert(token.label);
+        }
+
+        // Calls and tail calls leave the body, so the copy would need them
+        // resolved against the original. The runtime routines are the same
+        // for every copy.
+        auto leaf = std::none_of(code.begin(), code.end(), [&](const AsmToken &token) {
+            return OpCodeDefinition[OpCodeAsString(token.opcode)].second == ArgType::LABEL && !labels.count(token.label) && !runtime.count(token.label);
+        });
+
+        if (leaf && code.size() <= inlineLimit)
+            inlinable.emplace(name, Inlinable{params.size(), frame, code});
+    }
+
     add(asmTokens, OpCode::NOP, name + "_END");
 }
 
@@ -2767,18 +4204,38 @@ static Struct define_struct(int cpu, std::vector<AsmToken> &asmTokens, const std
     check(tokens[current++], TokenType::RIGHT_BRACE, "`}' expected");
     check(tokens[current++], TokenType::SEMICOLON, "`;' expected");
 
+    if (optimising && slots.size())
+        pools[name] = env->create("pool " + name, Pointer);
+
     return env->defineStruct(name, slots);
 }
 
-std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens) {
+static std::vector<AsmToken> program(const int cpu, const std::vector<Token> &tokens) {
     std::vector<AsmToken> asmTokens;
 
+    inlinable.clear();
+    runtime.clear();
+    pools.clear();
+    functionLabels.clear();
+
+    current = 0;
+    operands.clear();
+    StringTable.clear();
+
     asmTokens.push_back(AsmToken(OpCode::NOP));
 
     env = Environment::createGlobal(0);
 
+    interned.clear();
+
+    if (internStrings)
+        intern(tokens);
+
     //addPointer(asmTokens, OpCode::SETC, 0);
 
+    // The first statement that takes a global slot from the string table
+    std::optional<size_t> overflow;
+
     while (current < tokens.size()) {
         auto token = tokens[current];
 
@@ -2789,10 +4246,41 @@ std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens) {
         } else if (token.type == TokenType::STRUCT) {
             define_struct(cpu, asmTokens, tokens);
         } else {
+            auto start = asmTokens.size();
+            auto statement = current;
+            auto mark = env->frameSize();
+
             declaration(cpu, asmTokens, tokens);
+
+            if (optimising)
+                reuse(asmTokens, start);
+
+            if (!overflow && env->frameSize() > Environment::GlobalSlots)
+                overflow = statement;
+
+            // Nothing reads the statement's temporaries once it is over, so
+            // the next statement may have their slots
+            env->releaseTemporaries(mark);
         }
     }
 
+    spill(asmTokens);
+
+    if (overflow && StringTable.size())
+        error(tokens[*overflow], "Globals overlap the string table at slot " + std::to_string(Environment::GlobalSlots));
+
+    std::vector<AsmToken> prologue;
+
+    // Every pool starts out empty, before any code can allocate from it
+    if (pools.size())
+        addValue16(prologue, OpCode::SETC, Int16AsValue(0));
+
+    for (const auto &pool : pools)
+        addPointer(prologue, OpCode::STOREC, pool.second);
+
+    runtimeRoutines(prologue);
+    asmTokens.insert(asmTokens.begin()+1, prologue.begin(), prologue.end());
+
     std::vector<AsmToken> data;
 
     for (auto entry : StringTable) {
@@ -2807,3 +4295,42 @@ std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens) {
 
     return data;
 }
+
+std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens, const bool optimise, const size_t inline_limit, FunctionLabels *functions) {
+    optimising = optimise;
+    inlineLimit = inline_limit;
+
+    reassigned = optimise ? reassignedNames(tokens) : std::set<std::string>();
+    trackLengths = optimise;
+    internStrings = optimise;
+    stringsModified = false;
+    warnings = true;
+
+    candidates.clear();
+    escaping.clear();
+    owning = false;
+
+    auto asmTokens = program(cpu, tokens);
+
+    // Lengths and shared literals may have been relied on before a write
+    // into a string showed up, so compile again without them
+    if (trackLengths && stringsModified) {
+        trackLengths = false;
+        internStrings = false;
+        warnings = false;
+        asmTokens = program(cpu, tokens);
+    }
+
+    // Now that every use has been seen, compile again owning the blocks
+    // that do not escape
+    if (std::any_of(candidates.begin(), candidates.end(), [](size_t declared) { return !escaping.count(declared); })) {
+        owning = true;
+        warnings = false;
+        asmTokens = program(cpu, tokens);
+    }
+
+    if (functions)
+        *functions = functionLabels;
+
+    return asmTokens;
+}
@@ -9,6 +9,6 @@
 #include "Parser.h"
 #include "Assembly.h"
 
-std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens);
+std::vector<AsmToken> compile(const int cpu, const std::vector<Token> &tokens, const bool optimise=false, const size_t inline_limit=0, FunctionLabels *functions=nullptr);
 
 #endif //__COMPILER_H__
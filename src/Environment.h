@@ -1,11 +1,15 @@
 #ifndef __ENVIRONMENT_H__
 #define __ENVIRONMENT_H__
 
+#include <algorithm>
 #include <cstdint>
 #include <map>
 #include <memory>
 #include <optional>
+#include <string>
+#include <unordered_map>
 #include <variant>
+#include <vector>
 #include <iostream>
 
 enum class SimpleType {
@@ -23,11 +27,12 @@ typedef std::variant<struct Struct, struct Array, struct String, SimpleType> Val
 struct String {
     std::string literal;
     size_t allocated;
+    std::optional<size_t> length;
 
     String() : literal(""), allocated(0) {
     }
 
-    String(const std::string &value) : literal(value), allocated(value.size()+1) {
+    String(const std::string &value) : literal(value), allocated(value.size()+1), length(value.size()) {
     }
 
     String(size_t allocated) : literal(""), allocated(allocated) {
@@ -86,26 +91,132 @@ struct Function {
     }
 };
 
+// A block of `type' that a variable in `slot' alone points to, allocated by
+// the `var' token at `declared'
+struct Block {
+    int32_t slot;
+    ValueType type;
+    size_t declared;
+};
+
+class Environment;
+
+// A name bound in one scope
+template <typename T>
+struct Binding {
+    const Environment *scope;
+    T value;
+};
+
+struct Variable {
+    uint32_t slot;
+    ValueType type;
+    bool constant;
+    std::optional<std::variant<uint32_t, float>> value;
+};
+
+// Every name visible from the innermost scope, in one table shared by the
+// whole chain. Names are interned once and their bindings stacked with the
+// innermost last, so a lookup is a single hash instead of a walk up the
+// parents.
+class Symbols {
+    private:
+        std::unordered_map<std::string, size_t> ids;
+
+    public:
+        std::vector<std::vector<Binding<Variable>>> variables;
+        std::vector<std::vector<Binding<Function>>> functions;
+        std::vector<std::vector<Binding<Struct>>> structs;
+
+        size_t intern(const std::string &name) {
+            auto found = ids.find(name);
+            if (found != ids.end())
+                return found->second;
+
+            size_t id = ids.size();
+            ids.emplace(name, id);
+            variables.emplace_back();
+            functions.emplace_back();
+            structs.emplace_back();
+            return id;
+        }
+
+        std::optional<size_t> id(const std::string &name) const {
+            auto found = ids.find(name);
+            if (found != ids.end())
+                return found->second;
+
+            return std::nullopt;
+        }
+
+        template <typename T>
+        const std::vector<Binding<T>> *bindings(const std::vector<std::vector<Binding<T>>> &table, const std::string &name) const {
+            auto found = id(name);
+            if (!found || table[*found].empty())
+                return NULL;
+
+            return &table[*found];
+        }
+
+        template <typename T>
+        const Binding<T> *find(const std::vector<std::vector<Binding<T>>> &table, const std::string &name) const {
+            auto found = bindings(table, name);
+            return found ? &found->back() : NULL;
+        }
+};
+
 class Environment {
     private:
-        std::map<const std::string, std::pair<uint32_t, ValueType>> vars;
-        std::map<const std::string, uint32_t> vals;
-        std::map<const std::string, Function> functions;
-        std::map<const std::string, Struct> structs;
+        enum class Kind {
+            VARIABLE,
+            FUNCTION,
+            STRUCT
+        };
+
+        std::shared_ptr<Symbols> symbols;
+        // The names bound by this scope, unbound again in reverse when it ends
+        std::vector<std::pair<Kind, size_t>> bound;
+        size_t variables = 0;
+        std::vector<Block> owned;
         std::shared_ptr<Environment> parent;
         const int32_t offset;
 
         const std::string functionName;
 
         int localBlocks = 0;
-        int32_t stringTableOffset = 256;
-        Environment(int32_t offset) : parent(NULL), offset(offset), functionName("") {
+        int32_t stringTableOffset = GlobalSlots;
+
+        // One past the highest slot used so far, shared by every scope of a
+        // function
+        std::shared_ptr<int32_t> highest;
+
+        Environment(int32_t offset) : symbols(std::make_shared<Symbols>()), parent(NULL), offset(offset), functionName(""), highest(std::make_shared<int32_t>(offset)) {
         }
 
-        Environment(std::shared_ptr<Environment> parent, const std::string &functionName) : parent(parent), offset(0), functionName(functionName) {
+        Environment(std::shared_ptr<Environment> parent, const std::string &functionName) : symbols(parent->symbols), parent(parent), offset(0), functionName(functionName), highest(std::make_shared<int32_t>(0)) {
         }
 
-        Environment(std::shared_ptr<Environment> parent, int32_t offset, const std::string &functionName) : parent(parent), offset(offset), functionName(functionName) {
+        Environment(std::shared_ptr<Environment> parent, int32_t offset, const std::string &functionName) : symbols(parent->symbols), parent(parent), offset(offset), functionName(functionName), highest(parent->highest) {
+        }
+
+        template <typename T>
+        Binding<T> *local(std::vector<std::vector<Binding<T>>> &table, size_t id) const {
+            if (!table[id].empty() && table[id].back().scope == this)
+                return &table[id].back();
+
+            return NULL;
+        }
+
+        template <typename T>
+        Binding<T> *local(std::vector<std::vector<Binding<T>>> &table, const std::string &name) const {
+            auto id = symbols->id(name);
+            return id ? local(table, *id) : NULL;
+        }
+
+        template <typename T>
+        void bind(std::vector<std::vector<Binding<T>>> &table, Kind kind, size_t id, const T &value) {
+            table[id].push_back(Binding<T>{this, value});
+            bound.push_back(std::make_pair(kind, id));
         }
 
     public:
@@ -122,57 +233,72 @@ class Environment {
         }
 
         std::shared_ptr<Environment> endScope() {
-            auto localBlock = std::to_string(parent->localBlocks);
+            for (auto binding = bound.rbegin(); binding != bound.rend(); binding++) {
+                switch (binding->first) {
+                    case Kind::VARIABLE:
+                        symbols->variables[binding->second].pop_back();
+                        break;
+                    case Kind::FUNCTION:
+                        symbols->functions[binding->second].pop_back();
+                        break;
+                    case Kind::STRUCT:
+                        symbols->structs[binding->second].pop_back();
+                        break;
+                }
+            }
+            bound.clear();
+
             parent->localBlocks += this->size();
             return parent;
         }
 
         Struct defineStruct(const std::string &name, std::vector<std::pair<std::string, ValueType>> slotlist) {
             auto _struct = Struct(name, slotlist);
-            structs.insert(std::make_pair(name, _struct));
+            auto id = symbols->intern(name);
+            if (!local(symbols->structs, id))
+                bind(symbols->structs, Kind::STRUCT, id, _struct);
             return _struct;
         }
 
         Function defineFunction(const std::string &name, std::vector<std::pair<std::string, ValueType>> params, ValueType returnType) {
             auto function = Function(name, params, returnType);
-            functions.emplace(name, function);
+            auto id = symbols->intern(name);
+            if (!local(symbols->functions, id))
+                bind(symbols->functions, Kind::FUNCTION, id, function);
             return function;
         }
 
         void updateStruct(const std::string &name, const Struct &_struct) {
-            structs.erase(name);
-            structs.emplace(name, _struct);
+            auto id = symbols->intern(name);
+            if (local(symbols->structs, id))
+                symbols->structs[id].back().value = _struct;
+            else
+                bind(symbols->structs, Kind::STRUCT, id, _struct);
         }
 
         void updateFunction(const std::string &name, const Function &function) {
-            functions.erase(name);
-            functions.emplace(name, function);
+            auto id = symbols->intern(name);
+            if (local(symbols->functions, id))
+                symbols->functions[id].pop_back();
+            else
+                bound.push_back(std::make_pair(Kind::FUNCTION, id));
+            symbols->functions[id].push_back(Binding<Function>{this, function});
         }
 
         Struct getStruct(const std::string &name) const {
-            auto found = structs.find(name);
-            if (found != structs.end()) {
-                return found->second;
-            } else {
-                if (parent) {
-                    return parent->getStruct(name);
-                } else {
-                    throw std::invalid_argument("Undefined struct `" + name + "'");
-                }
-            }
+            auto found = symbols->find(symbols->structs, name);
+            if (!found)
+                throw std::invalid_argument("Undefined struct `" + name + "'");
+
+            return found->value;
         }
 
         Function getFunction(const std::string &name) const {
-            auto found = functions.find(name);
-            if (found != functions.end()) {
-                return found->second;
-            } else {
-                if (parent) {
-                    return parent->getFunction(name);
-                } else {
-                    throw std::invalid_argument("Undefined function `" + name + "'");
-                }
-            }
+            auto found = symbols->find(symbols->functions, name);
+            if (!found)
+                throw std::invalid_argument("Undefined function `" + name + "'");
+
+            return found->value;
         }
 
         const size_t Offset() const {
@@ -180,136 +306,142 @@ class Environment {
         }
 
         const size_t size() const {
-            return vars.size();
+            return variables;
         }
 
         uint32_t get(const std::string &name) const {
-            auto found = vars.find(name);
+            auto found = symbols->find(symbols->variables, name);
+            if (!found)
+                throw std::invalid_argument("Unknown variable `" + name + "'");
 
-            if (found != vars.end()) {
-                return found->second.first;
-            } else {
-                if (parent) {
-                    return parent->get(name);
-                } else {
-                    throw std::invalid_argument("Unknown variable `" + name + "'");
-                }
-            }
+            return found->value.slot;
         }
 
         ValueType getType(const std::string &name) const {
-            auto found = vars.find(name);
+            auto found = symbols->find(symbols->variables, name);
+            if (!found)
+                throw std::invalid_argument("Unknown variable `" + name + "'");
 
-            if (found != vars.end()) {
-                return found->second.second;
-            } else {
-                if (parent) {
-                    return parent->getType(name);
-                } else {
-                    throw std::invalid_argument("Unknown variable `" + name + "'");
-                }
-            }
+            return found->value.type;
         }
 
 
-        bool isStruct(const std::string &name) {
-            auto found = structs.find(name);
-
-            if (found != structs.end()) {
-                return true;
-            } else if (parent) {
-                return parent->isStruct(name);
-            }
-
-            return false;
+        bool isStruct(const std::string &name) const {
+            return symbols->find(symbols->structs, name) != NULL;
         }
 
-        bool isFunction(const std::string &name) {
-            auto found = functions.find(name);
-
-            if (found != functions.end()) {
-                return true;
-            } else if (parent) {
-                return parent->isFunction(name);
-            }
-
-            return false;
+        bool isFunction(const std::string &name) const {
+            return symbols->find(symbols->functions, name) != NULL;
         }
 
+        // A name declared constant in any enclosing scope stays constant,
+        // even where it is shadowed
         bool isConstant(const std::string &name) const {
-            auto found = vals.find(name);
-
-            if (found != vals.end()) {
-                return true;
-            }
-
-            if (parent) {
-                return parent->isConstant(name);
-            }
+            auto found = symbols->bindings(symbols->variables, name);
+            if (!found)
+                return false;
 
-            return false;
+            return std::any_of(found->begin(), found->end(), [](const Binding<Variable> &binding) {
+                return binding.value.constant;
+            });
         }
 
         bool isVariable(const std::string &name) const {
-            auto found = vars.find(name);
-
-            if (found != vars.end()) {
-                return true;
-            }
-
-            if (parent) {
-                return parent->isVariable(name);
-            }
-
-            return false;
+            return symbols->find(symbols->variables, name) != NULL;
         }
 
 
-        bool isGlobal(const std::string &name) {
-            auto found = vars.find(name);
-
-            if (found != vars.end()) {
-                return !inFunction();
-            }
+        bool isGlobal(const std::string &name) const {
+            auto found = symbols->find(symbols->variables, name);
+            if (!found)
+                throw std::invalid_argument("Unknown variable `" + name + "'");
 
-            if (parent) {
-                return parent->isGlobal(name);
-            } else {
-                if (found == vars.end())
-                    throw std::invalid_argument("Unknown variable `" + name + "'");
-                return true;
-            }
+            return !found->scope->inFunction();
         }
 
         int32_t create(const std::string &name, ValueType type, size_t count=1) {
-            auto existing = vars.find(name);
-            if (existing != vars.end()) {
-                return existing->second.first;
+            auto existing = local(symbols->variables, name);
+            if (existing) {
+                return existing->value.slot;
             }
 
-            int32_t next = Offset() + vars.size() + localBlocks;
+            int32_t next = Offset() + size() + localBlocks;
             for (size_t i = 0; i  < count; i++) {
-                vars.insert(std::make_pair(name + std::string(i, ' '), std::make_pair(next+i, type)));
+                auto id = symbols->intern(name + std::string(i, ' '));
+                if (local(symbols->variables, id))
+                    continue;
+
+                bind(symbols->variables, Kind::VARIABLE, id, Variable{(uint32_t)(next+i), type, false, std::nullopt});
+                variables++;
             }
 
+            *highest = std::max(*highest, next + (int32_t)count);
+
             //std::cerr << name << "@" << next << std::endl;
 
             return next;
         }
 
+        // An unnamed slot above every variable declared so far, for values
+        // the compiler keeps for itself. Variables declared afterwards may
+        // reuse it.
+        int32_t createTemporary(size_t count=1) {
+            int32_t next = *highest;
+            *highest += count;
+            return next;
+        }
+
+        // The string table starts at this slot, above the globals
+        static const int32_t GlobalSlots = 256;
+
+        // The slots a function's frame is kept within when the compiler has
+        // the choice. The frames belong to the VM, which is not part of this
+        // tree.
+        static const int32_t FrameSlots = 256;
+
+        // Slots used by the function so far, counting temporaries
+        int32_t frameSize() const {
+            return *highest;
+        }
+
+        // Whether `count' more temporaries fit below the string table, or
+        // within FrameSlots in a function
+        bool fits(size_t count) const {
+            return *highest + (int32_t)count <= (inFunction() ? FrameSlots : GlobalSlots);
+        }
+
+        // Gives back the temporaries created since frameSize() was `mark',
+        // keeping the slots of any variables declared in the meantime
+        void releaseTemporaries(int32_t mark) {
+            *highest = std::max(mark, (int32_t)(Offset() + size() + localBlocks));
+        }
+
         int32_t createConstant(const std::string &name, ValueType type, size_t count=1) {
-            auto existing = vars.find(name);
-            if (existing != vars.end()) {
+            if (local(symbols->variables, name)) {
                 throw std::invalid_argument("Cannot create constant from existing name `" + name + "'");
             }
 
             int32_t next = create(name, type, count);
 
-            vals[name] = next;
+            local(symbols->variables, name)->value.constant = true;
 
             return next;
         }
 
+        void setConstantValue(const std::string &name, std::variant<uint32_t, float> value) {
+            auto found = local(symbols->variables, name);
+            if (found)
+                found->value.value = value;
+        }
+
+        std::optional<std::variant<uint32_t, float>> getConstantValue(const std::string &name) const {
+            auto found = symbols->find(symbols->variables, name);
+            if (found)
+                return found->value.value;
+
+            return std::nullopt;
+        }
+
         int32_t defineString(const std::string &value) {
             if (parent) {
                 return parent->defineString(value);
@@ -323,19 +455,59 @@ class Environment {
         }
 
         uint32_t set(const std::string &name, ValueType type) {
-            auto found = vars.find(name);
+            auto found = symbols->find(symbols->variables, name);
+            if (!found)
+                throw std::invalid_argument("Unknown variable `" + name + "'");
 
-            if (found != vars.end()) {
-                //vars[name] = std::make_pair(found->second.first, type);
-                found->second.second = type;
-                return found->second.first;
-            } else {
-                if (parent) {
-                    return parent->get(name);
-                } else {
-                    throw std::invalid_argument("Unknown variable `" + name + "'");
-                }
-            }
+            auto existing = local(symbols->variables, name);
+            if (existing)
+                existing->value.type = type;
+
+            return found->value.slot;
+        }
+
+        // The slot holds the only pointer to a block allocated in this
+        // scope by the `var' at `declared', which is freed whenever the
+        // scope is left
+        void own(int32_t slot, ValueType type, size_t declared) {
+            auto found = std::find_if(owned.begin(), owned.end(), [slot](const Block &block) {
+                return block.slot == slot;
+            });
+
+            if (found == owned.end())
+                owned.push_back(Block{slot, type, declared});
+        }
+
+        // The variable may hand its pointer on, so the block it holds, if
+        // its scope owns one, is no longer freed. Gives the `var' that
+        // allocated the block.
+        std::optional<size_t> disown(const std::string &name) {
+            auto found = symbols->find(symbols->variables, name);
+            if (!found)
+                return std::nullopt;
+
+            auto scope = this;
+            while (scope && scope != found->scope)
+                scope = scope->parent.get();
+
+            if (!scope)
+                return std::nullopt;
+
+            auto slot = (int32_t)found->value.slot;
+            auto block = std::find_if(scope->owned.begin(), scope->owned.end(), [slot](const Block &block) {
+                return block.slot == slot;
+            });
+
+            if (block == scope->owned.end())
+                return std::nullopt;
+
+            auto declared = block->declared;
+            scope->owned.erase(block);
+            return declared;
+        }
+
+        const std::vector<Block> &Owned() const {
+            return owned;
         }
 
         std::shared_ptr<Environment> Parent() const {
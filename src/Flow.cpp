@@ -0,0 +1,1053 @@
+#include "Flow.h"
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <tuple>
+
+static bool hasLabel(const AsmToken &token) {
+    return token.label.size() && OpCodeDefinition[OpCodeAsString(token.opcode)].second != ArgType::LABEL;
+}
+
+static bool endsBlock(OpCode opcode) {
+    return OpCodeIsJump(opcode) || opcode == OpCode::JMPIDX || opcode == OpCode::CALL || opcode == OpCode::RETURN || opcode == OpCode::HALT;
+}
+
+std::string BasicBlock::label() const {
+    return asmTokens.size() && hasLabel(asmTokens[0]) ? asmTokens[0].label : "";
+}
+
+const AsmToken &BasicBlock::terminator() const {
+    return asmTokens.back();
+}
+
+void ControlFlowGraph::link(size_t from, size_t to) {
+    blocks[from].successors.push_back(to);
+    blocks[to].predecessors.push_back(from);
+}
+
+// Blocks start at every label and after every jump, call or return. A CALL
+// ends its block so that the callee and the return point are both
+// successors.
+ControlFlowGraph::ControlFlowGraph(const std::vector<AsmToken> &asmTokens) {
+    for (const auto &token : asmTokens) {
+        if (blocks.empty() || hasLabel(token) || endsBlock(blocks.back().terminator().opcode)) {
+            blocks.push_back(BasicBlock());
+        }
+
+        if (hasLabel(token))
+            labels[token.label] = blocks.size()-1;
+
+        blocks.back().asmTokens.push_back(token);
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const auto &last = blocks[i].terminator();
+
+        if (OpCodeIsJump(last.opcode) || last.opcode == OpCode::CALL) {
+            auto target = labels.find(last.label);
+
+            if (target != labels.end())
+                link(i, target->second);
+        }
+
+        // Each entry of a jump table is a JMP, and so a block of its own
+        if (last.opcode == OpCode::JMPIDX) {
+            for (size_t entry = 2; entry <= (size_t)std::get<int16_t>(*last.arg) && i+entry < blocks.size(); entry++)
+                link(i, i+entry);
+        }
+
+        if (last.opcode != OpCode::JMP && last.opcode != OpCode::RETURN && last.opcode != OpCode::HALT && i+1 < blocks.size())
+            link(i, i+1);
+    }
+}
+
+std::vector<bool> ControlFlowGraph::reachable() const {
+    std::vector<bool> seen(blocks.size(), false);
+    std::vector<size_t> work;
+
+    if (blocks.size()) {
+        seen[0] = true;
+        work.push_back(0);
+    }
+
+    while (work.size()) {
+        auto block = work.back();
+        work.pop_back();
+
+        for (auto next : blocks[block].successors) {
+            if (!seen[next]) {
+                seen[next] = true;
+                work.push_back(next);
+            }
+        }
+    }
+
+    return seen;
+}
+
+std::vector<AsmToken> ControlFlowGraph::linearise(const std::vector<bool> &keep) const {
+    std::vector<AsmToken> asmTokens;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (keep[i])
+            asmTokens.insert(asmTokens.end(), blocks[i].asmTokens.begin(), blocks[i].asmTokens.end());
+    }
+
+    return asmTokens;
+}
+
+std::vector<AsmToken> ControlFlowGraph::linearise() const {
+    return linearise(std::vector<bool>(blocks.size(), true));
+}
+
+bool removeUnreachable(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits) {
+    ControlFlowGraph cfg(asmTokens);
+
+    auto reachable = cfg.reachable();
+    auto removed = std::count(reachable.begin(), reachable.end(), false);
+
+    if (removed == 0)
+        return false;
+
+    asmTokens = cfg.linearise(reachable);
+    hits["unreachable-block"] += removed;
+
+    return true;
+}
+
+// Loads and stores of a single register. READ and WRITE address the frame,
+// LOAD and STORE absolute memory, so the two can only alias each other
+// through the frame pointer.
+struct Access {
+    Effect reg;
+    bool frame;
+};
+
+struct Location {
+    bool frame;
+    AsmToken token;
+};
+
+static const std::map<OpCode, Access> Loads = {
+    {OpCode::LOADA, {EFFECT_A, false}}, {OpCode::LOADB, {EFFECT_B, false}}, {OpCode::LOADC, {EFFECT_C, false}},
+    {OpCode::READA, {EFFECT_A, true}}, {OpCode::READB, {EFFECT_B, true}}, {OpCode::READC, {EFFECT_C, true}},
+};
+
+static const std::map<OpCode, Access> Stores = {
+    {OpCode::STOREA, {EFFECT_A, false}}, {OpCode::STOREB, {EFFECT_B, false}}, {OpCode::STOREC, {EFFECT_C, false}},
+    {OpCode::WRITEA, {EFFECT_A, true}}, {OpCode::WRITEB, {EFFECT_B, true}}, {OpCode::WRITEC, {EFFECT_C, true}},
+};
+
+static const std::map<OpCode, Effect> IndexedStores = {
+    {OpCode::WRITEAX, EFFECT_A}, {OpCode::WRITEBX, EFFECT_B}, {OpCode::WRITECX, EFFECT_C},
+};
+
+static bool same(const Location &a, const Location &b) {
+    return a.frame == b.frame && a.token.arg == b.token.arg;
+}
+
+static bool mayAlias(const Location &a, const Location &b) {
+    return a.frame != b.frame || same(a, b);
+}
+
+static bool contains(const std::vector<Location> &locations, const Location &location) {
+    return std::any_of(locations.begin(), locations.end(), [&](const Location &l) { return same(l, location); });
+}
+
+// Within a block, remembers which memory locations each of A, B and C is
+// known to hold, and drops loads of a value that is already in the register.
+static void forwardStores(BasicBlock &block, std::map<std::string, int> &hits) {
+    std::map<Effect, std::vector<Location>> known;
+    std::vector<AsmToken> output;
+
+    for (auto token : block.asmTokens) {
+        auto load = Loads.find(token.opcode);
+        auto store = Stores.find(token.opcode);
+
+        if (load != Loads.end()) {
+            auto reg = load->second.reg;
+            Location location = { load->second.frame, token };
+
+            if (contains(known[reg], location)) {
+                if (token.label.size())
+                    output.push_back(AsmToken(OpCode::NOP).setLabel(token.label));
+                hits["load-forward"]++;
+                continue;
+            }
+
+            if (reg != EFFECT_C && contains(known[EFFECT_C], location)) {
+                token = AsmToken(reg == EFFECT_A ? OpCode::MOVCA : OpCode::MOVCB).setLabel(token.label);
+                known[reg] = known[EFFECT_C];
+                hits["load-move"]++;
+            } else {
+                known[reg] = { location };
+            }
+        } else if (store != Stores.end()) {
+            auto reg = store->second.reg;
+            Location location = { store->second.frame, token };
+
+            for (auto &entry : known) {
+                if (entry.first != reg) {
+                    auto &locations = entry.second;
+                    locations.erase(std::remove_if(locations.begin(), locations.end(), [&](const Location &l) {
+                        return mayAlias(l, location);
+                    }), locations.end());
+                }
+            }
+
+            // Whatever the store overwrote now holds this register's value,
+            // so facts about the register itself all still hold
+            if (!contains(known[reg], location))
+                known[reg].push_back(location);
+        } else if (token.opcode == OpCode::MOVCA || token.opcode == OpCode::MOVCB) {
+            known[token.opcode == OpCode::MOVCA ? EFFECT_A : EFFECT_B] = known[EFFECT_C];
+        } else {
+            auto writes = OpCodeWrites(token.opcode);
+            auto indexed = IndexedStores.find(token.opcode);
+
+            if (writes & EFFECT_MEMORY) {
+                for (auto &entry : known) {
+                    if (indexed == IndexedStores.end() || entry.first != indexed->second)
+                        entry.second.clear();
+                }
+            }
+
+            for (auto reg : { EFFECT_A, EFFECT_B, EFFECT_C }) {
+                if (writes & reg)
+                    known[reg].clear();
+            }
+        }
+
+        output.push_back(token);
+    }
+
+    block.asmTokens = output;
+}
+
+// A store is dead when the same location is stored to again later in the
+// block with nothing in between that might read it.
+static void removeDeadStores(BasicBlock &block, std::map<std::string, int> &hits) {
+    std::vector<AsmToken> output;
+    const auto &asmTokens = block.asmTokens;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        auto store = Stores.find(asmTokens[i].opcode);
+        bool dead = false;
+
+        if (store != Stores.end() && asmTokens[i].label.empty()) {
+            Location location = { store->second.frame, asmTokens[i] };
+
+            for (size_t j = i+1; j < asmTokens.size(); j++) {
+                const auto &next = asmTokens[j];
+                auto later = Stores.find(next.opcode);
+                auto load = Loads.find(next.opcode);
+
+                if (later != Stores.end() && same(location, { later->second.frame, next })) {
+                    dead = true;
+                    break;
+                }
+
+                if (load != Loads.end() && !mayAlias(location, { load->second.frame, next }))
+                    continue;
+
+                if (OpCodeReads(next.opcode) & (EFFECT_MEMORY|EFFECT_CONTROL))
+                    break;
+            }
+        }
+
+        if (dead) {
+            hits["dead-store"]++;
+        } else {
+            output.push_back(asmTokens[i]);
+        }
+    }
+
+    block.asmTokens = output;
+}
+
+bool forwardMemory(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits) {
+    ControlFlowGraph cfg(asmTokens);
+    auto before = asmTokens.size();
+
+    for (size_t i = 0; i < cfg.size(); i++) {
+        forwardStores(cfg[i], hits);
+        removeDeadStores(cfg[i], hits);
+    }
+
+    asmTokens = cfg.linearise();
+
+    return asmTokens.size() != before;
+}
+
+// Opcodes that compute a result from registers alone but may trap or carry
+// hidden state, and so cannot be executed speculatively or just once.
+static bool hoistable(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::DIV: case OpCode::IDIV: case OpCode::MOD:
+        case OpCode::RND: case OpCode::SEED:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// A loop-invariant computation is a run of instructions, possibly
+// interleaved with others, that only use registers set earlier in the run, constants and loads of locations the
+// loop never stores to, and whose only result still needed afterwards is
+// the value left in C. Each run is computed once in front of the loop and
+// replaced by a load of the temporary it was saved in. CALL, SYSCALL, ALLOC
+// and indexed stores may write anywhere, so a loop containing one of them
+// only has constant computations to offer.
+std::vector<AsmToken> hoistInvariants(std::vector<AsmToken> &loop, const Temporary &temporary) {
+    const uint32_t registers = EFFECT_A|EFFECT_B|EFFECT_C;
+    std::vector<Location> stored;
+    bool clobbered = false;
+
+    for (const auto &token : loop) {
+        auto store = Stores.find(token.opcode);
+
+        if (store != Stores.end()) {
+            stored.push_back({ store->second.frame, token });
+        } else if (OpCodeWrites(token.opcode) & EFFECT_MEMORY) {
+            clobbered = true;
+        }
+    }
+
+    auto invariant = [&](const AsmToken &token) {
+        auto load = Loads.find(token.opcode);
+
+        if (load != Loads.end()) {
+            Location location = { load->second.frame, token };
+
+            return !clobbered && std::none_of(stored.begin(), stored.end(), [&](const Location &l) {
+                return mayAlias(l, location);
+            });
+        }
+
+        return (OpCodeReads(token.opcode) & ~registers) == 0 && (OpCodeWrites(token.opcode) & ~registers) == 0 && hoistable(token.opcode);
+    };
+
+    std::vector<AsmToken> preheader;
+
+    for (size_t i = 0; i < loop.size(); i++) {
+        // Registers holding a value computed by the run. The instructions it
+        // is interleaved with stay in the loop as long as they do not use one.
+        uint32_t ours = EFFECT_NONE;
+        std::vector<size_t> run;
+        size_t end = 0;
+
+        for (size_t j = i; j < loop.size(); j++) {
+            const auto &token = loop[j];
+            auto reads = OpCodeReads(token.opcode);
+            auto writes = OpCodeWrites(token.opcode);
+
+            if (hasLabel(token) || ((reads|writes) & EFFECT_CONTROL))
+                break;
+
+            if (token.opcode != OpCode::NOP && invariant(token) && (reads & registers & ~ours) == 0) {
+                run.push_back(j);
+                ours |= writes;
+            } else if (j == i || (reads & ours)) {
+                break;
+            } else {
+                ours &= ~writes;
+                continue;
+            }
+
+            if (run.size() < 2 || !(ours & EFFECT_C) || isDead(loop, j+1, EFFECT_C))
+                continue;
+
+            if (((ours & EFFECT_A) && !isDead(loop, j+1, EFFECT_A)) || ((ours & EFFECT_B) && !isDead(loop, j+1, EFFECT_B)))
+                continue;
+
+            end = run.size();
+        }
+
+        if (end == 0)
+            continue;
+
+        run.resize(end);
+
+        auto slot = temporary();
+        if (!slot)
+            break;
+
+        for (auto j : run)
+            preheader.push_back(loop[j]);
+        preheader.push_back(slot->first);
+
+        auto at = run.back();
+
+        for (auto j = run.rbegin(); j != run.rend(); j++)
+            loop.erase(loop.begin()+*j);
+
+        loop.insert(loop.begin()+at-(run.size()-1), slot->second);
+    }
+
+    return preheader;
+}
+
+// Immediates compare by representation, so 0.0 and -0.0 are told apart
+static std::pair<size_t, std::string> immediate(const AsmToken &token) {
+    if (token.isNone())
+        return { 0, "" };
+
+    return { token.arg->index()+1, std::visit([](const auto &value) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::string>) {
+            return value;
+        } else {
+            std::string bytes(sizeof(value), '\0');
+            std::memcpy(bytes.data(), &value, sizeof(value));
+            return bytes;
+        }
+    }, *token.arg) };
+}
+
+// Operations whose result in C depends only on the registers they read
+static bool pure(OpCode opcode) {
+    const uint32_t registers = EFFECT_A|EFFECT_B|EFFECT_C;
+
+    return (OpCodeReads(opcode) & ~registers) == 0 && OpCodeWrites(opcode) == EFFECT_C && opcode != OpCode::RND;
+}
+
+// Removes instructions whose results are never used. A value left in A, B
+// or C at the end of the block may be used later, and a push and the pop it
+// is matched with are removed together so the stack stays balanced.
+static void removeDeadCode(std::vector<AsmToken> &asmTokens) {
+    const uint32_t registers = EFFECT_A|EFFECT_B|EFFECT_C;
+    std::vector<std::vector<size_t>> uses(asmTokens.size());
+    std::vector<long> partner(asmTokens.size(), -1);
+    std::map<Effect, long> last = { {EFFECT_A, -1}, {EFFECT_B, -1}, {EFFECT_C, -1} };
+    std::vector<size_t> pushes;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        auto opcode = asmTokens[i].opcode;
+        auto reads = OpCodeReads(opcode);
+        auto writes = OpCodeWrites(opcode);
+
+        for (auto &entry : last) {
+            if ((reads & entry.first) && entry.second >= 0)
+                uses[i].push_back(entry.second);
+        }
+
+        if (opcode == OpCode::POPA || opcode == OpCode::POPB || opcode == OpCode::POPC || opcode == OpCode::POPIDX) {
+            if (pushes.size()) {
+                partner[i] = pushes.back();
+                partner[pushes.back()] = i;
+                pushes.pop_back();
+            }
+        } else if (opcode == OpCode::PUSHA || opcode == OpCode::PUSHB || opcode == OpCode::PUSHC || opcode == OpCode::PUSHIDX) {
+            pushes.push_back(i);
+        } else if ((reads|writes) & EFFECT_STACK) {
+            pushes.clear();
+        }
+
+        for (auto &entry : last) {
+            if (writes & entry.first)
+                entry.second = i;
+        }
+    }
+
+    std::vector<bool> live(asmTokens.size(), false);
+    std::vector<size_t> work;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        const auto &token = asmTokens[i];
+        auto reads = OpCodeReads(token.opcode);
+        auto writes = OpCodeWrites(token.opcode);
+
+        bool removable = token.opcode != OpCode::NOP && !hasLabel(token) && hoistable(token.opcode) &&
+            (reads & ~(registers|EFFECT_MEMORY|EFFECT_STACK)) == 0 && (writes & ~(registers|EFFECT_STACK)) == 0 &&
+            (((reads|writes) & EFFECT_STACK) == 0 || partner[i] >= 0);
+
+        if (!removable || std::any_of(last.begin(), last.end(), [&](const std::pair<const Effect, long> &entry) { return entry.second == (long)i; })) {
+            live[i] = true;
+            work.push_back(i);
+        }
+    }
+
+    while (work.size()) {
+        auto i = work.back();
+        work.pop_back();
+
+        auto needed = uses[i];
+        if (partner[i] >= 0)
+            needed.push_back(partner[i]);
+
+        for (auto j : needed) {
+            if (!live[j]) {
+                live[j] = true;
+                work.push_back(j);
+            }
+        }
+    }
+
+    std::vector<AsmToken> output;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        if (live[i])
+            output.push_back(asmTokens[i]);
+    }
+
+    asmTokens = output;
+}
+
+// Gives every value computed in the block a number, shared by computations
+// that must give the same result: the same constant, a location loaded again
+// before anything could have stored to it, or the same pure operation on the
+// same numbers. An operation that recomputes a number C already holds is
+// dropped; otherwise it becomes a load of a variable that holds the number
+// or of a temporary the first computation is saved in. What fed the
+// recomputation is then dead, and removed.
+static void numberValues(BasicBlock &block, bool separate, const Temporary &temporary) {
+    typedef std::tuple<OpCode, std::pair<size_t, std::string>, int, int, int> Expression;
+
+    auto alias = [&](const Location &a, const Location &b) {
+        return separate ? same(a, b) : mayAlias(a, b);
+    };
+
+    int numbers = 0;
+    std::map<Effect, int> reg = { {EFFECT_A, numbers++}, {EFFECT_B, numbers++}, {EFFECT_C, numbers++} };
+    std::vector<int> stack;
+    std::vector<std::pair<Location, int>> memory;
+    std::map<std::pair<size_t, std::string>, int> constants;
+    std::map<Expression, std::pair<int, size_t>> computed;
+
+    std::map<size_t, std::pair<AsmToken, AsmToken>> saved;
+    std::map<size_t, std::optional<AsmToken>> replaced;
+
+    // A register given the number it already holds needs no instruction
+    auto number = [&](int value, Effect to, size_t i) {
+        if (reg[to] == value)
+            replaced[i] = std::nullopt;
+
+        reg[to] = value;
+    };
+
+    const auto &asmTokens = block.asmTokens;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        const auto &token = asmTokens[i];
+        auto load = Loads.find(token.opcode);
+        auto store = Stores.find(token.opcode);
+        auto reads = OpCodeReads(token.opcode);
+        auto writes = OpCodeWrites(token.opcode);
+
+        if (load != Loads.end()) {
+            Location location = { load->second.frame, token };
+            auto known = std::find_if(memory.begin(), memory.end(), [&](const std::pair<Location, int> &entry) {
+                return same(entry.first, location);
+            });
+
+            if (known == memory.end()) {
+                memory.push_back({ location, numbers++ });
+                known = memory.end()-1;
+            }
+
+            number(known->second, load->second.reg, i);
+        } else if (store != Stores.end()) {
+            Location location = { store->second.frame, token };
+
+            memory.erase(std::remove_if(memory.begin(), memory.end(), [&](const std::pair<Location, int> &entry) {
+                return alias(entry.first, location);
+            }), memory.end());
+
+            memory.push_back({ location, reg[store->second.reg] });
+        } else if (token.opcode == OpCode::SETA || token.opcode == OpCode::SETB || token.opcode == OpCode::SETC) {
+            auto constant = constants.emplace(immediate(token), numbers);
+            if (constant.second)
+                numbers++;
+
+            number(constant.first->second, (Effect)writes, i);
+        } else if (token.opcode == OpCode::MOVCA || token.opcode == OpCode::MOVCB) {
+            reg[(Effect)writes] = reg[EFFECT_C];
+        } else if (token.opcode == OpCode::PUSHA || token.opcode == OpCode::PUSHB || token.opcode == OpCode::PUSHC) {
+            stack.push_back(reg[(Effect)(reads & ~EFFECT_STACK)]);
+        } else if (token.opcode == OpCode::POPA || token.opcode == OpCode::POPB || token.opcode == OpCode::POPC) {
+            auto to = (Effect)(writes & ~EFFECT_STACK);
+
+            if (stack.size()) {
+                reg[to] = stack.back();
+                stack.pop_back();
+            } else {
+                reg[to] = numbers++;
+            }
+        } else if (pure(token.opcode)) {
+            Expression expression = {
+                token.opcode, immediate(token),
+                reads & EFFECT_A ? reg[EFFECT_A] : -1,
+                reads & EFFECT_B ? reg[EFFECT_B] : -1,
+                reads & EFFECT_C ? reg[EFFECT_C] : -1
+            };
+
+            auto found = computed.find(expression);
+
+            if (found == computed.end()) {
+                reg[EFFECT_C] = numbers;
+                computed[expression] = { numbers++, i };
+                continue;
+            }
+
+            auto value = found->second.first;
+
+            if (reg[EFFECT_C] != value) {
+                auto held = std::find_if(memory.begin(), memory.end(), [&](const std::pair<Location, int> &entry) {
+                    return entry.second == value;
+                });
+
+                if (held != memory.end()) {
+                    replaced[i] = AsmToken(held->first.frame ? OpCode::READC : OpCode::LOADC).setLabel(token.label);
+                    replaced[i]->arg = held->first.token.arg;
+                } else {
+                    auto site = found->second.second;
+                    auto slot = saved.count(site) ? std::make_optional(saved.at(site)) : temporary();
+
+                    // With no slot left the value is computed again
+                    if (slot) {
+                        saved.emplace(site, *slot);
+                        replaced[i] = slot->second;
+                        replaced[i]->label = token.label;
+                    }
+                }
+            }
+
+            number(value, EFFECT_C, i);
+        } else {
+            if (token.opcode == OpCode::PUSHIDX) {
+                stack.push_back(numbers++);
+            } else if (token.opcode == OpCode::POPIDX) {
+                if (stack.size())
+                    stack.pop_back();
+            } else if ((reads|writes) & EFFECT_STACK) {
+                stack.clear();
+            }
+
+            if (writes & EFFECT_MEMORY)
+                memory.clear();
+
+            for (auto &entry : reg) {
+                if (writes & entry.first)
+                    entry.second = numbers++;
+            }
+        }
+    }
+
+    if (replaced.empty())
+        return;
+
+    std::vector<AsmToken> output;
+
+    for (size_t i = 0; i < asmTokens.size(); i++) {
+        auto replacement = replaced.find(i);
+
+        if (replacement == replaced.end()) {
+            output.push_back(asmTokens[i]);
+        } else if (replacement->second) {
+            output.push_back(*replacement->second);
+        } else if (hasLabel(asmTokens[i])) {
+            output.push_back(AsmToken(OpCode::NOP).setLabel(asmTokens[i].label));
+        }
+
+        if (saved.count(i))
+            output.push_back(saved.at(i).first);
+    }
+
+    removeDeadCode(output);
+
+    block.asmTokens = output;
+}
+
+void numberValues(std::vector<AsmToken> &asmTokens, bool separate, const Temporary &temporary) {
+    ControlFlowGraph cfg(asmTokens);
+
+    for (size_t i = 0; i < cfg.size(); i++)
+        numberValues(cfg[i], separate, temporary);
+
+    asmTokens = cfg.linearise();
+}
+
+// What is known of the value in a register, stack entry or variable. A byte
+// and an integer join to INTEGRAL, and anything else that differs to UNKNOWN.
+enum class Kind {
+    NONE,
+    BYTE,
+    INTEGER,
+    INTEGRAL,
+    FLOAT,
+    UNKNOWN
+};
+
+static bool integral(Kind kind) {
+    return kind == Kind::BYTE || kind == Kind::INTEGER || kind == Kind::INTEGRAL;
+}
+
+static Kind join(Kind a, Kind b) {
+    if (a == Kind::NONE || a == b)
+        return b;
+
+    if (b == Kind::NONE)
+        return a;
+
+    return integral(a) && integral(b) ? Kind::INTEGRAL : Kind::UNKNOWN;
+}
+
+static Kind constantKind(const AsmToken &token) {
+    const uint32_t QNAN = 0x7F800000;
+    const uint32_t SIGN = 0x80000000;
+    const uint32_t BYTE_BIT = 0x00010000;
+
+    if (token.isNone())
+        return Kind::UNKNOWN;
+
+    if (token.isFloat())
+        return Kind::FLOAT;
+
+    if (!std::holds_alternative<uint32_t>(*token.arg))
+        return Kind::UNKNOWN;
+
+    auto value = std::get<uint32_t>(*token.arg);
+
+    if ((value & (QNAN|SIGN)) == QNAN)
+        return value & BYTE_BIT ? Kind::BYTE : Kind::INTEGER;
+
+    return (value & QNAN) == QNAN ? Kind::UNKNOWN : Kind::FLOAT;
+}
+
+// The generic form of each typed operation, and the typed forms of each
+// generic one
+static const std::map<OpCode, std::pair<OpCode, OpCode>> Typed = {
+    {OpCode::ADD, {OpCode::ADDI, OpCode::ADDF}}, {OpCode::SUB, {OpCode::SUBI, OpCode::SUBF}},
+    {OpCode::MUL, {OpCode::MULI, OpCode::MULF}},
+    {OpCode::EQ, {OpCode::EQI, OpCode::EQF}}, {OpCode::NE, {OpCode::NEI, OpCode::NEF}},
+    {OpCode::LT, {OpCode::LTI, OpCode::LTF}}, {OpCode::LE, {OpCode::LEI, OpCode::LEF}},
+    {OpCode::GT, {OpCode::GTI, OpCode::GTF}}, {OpCode::GE, {OpCode::GEI, OpCode::GEF}},
+};
+
+static OpCode generic(OpCode opcode) {
+    for (const auto &entry : Typed) {
+        if (entry.second.first == opcode || entry.second.second == opcode)
+            return entry.first;
+    }
+
+    return opcode;
+}
+
+static bool comparison(OpCode opcode) {
+    opcode = generic(opcode);
+
+    return opcode != OpCode::ADD && opcode != OpCode::SUB && opcode != OpCode::MUL && Typed.count(opcode);
+}
+
+// The typed form to use for operands of kinds `a' and `b', or the generic
+// opcode itself. Arithmetic on two bytes stays generic, as its result is a
+// byte.
+static OpCode specialised(OpCode opcode, Kind a, Kind b) {
+    auto typed = Typed.find(generic(opcode));
+
+    if (typed == Typed.end())
+        return opcode;
+
+    if (a == Kind::FLOAT && b == Kind::FLOAT)
+        return typed->second.second;
+
+    if (integral(a) && integral(b) && (comparison(opcode) || a == Kind::INTEGER || b == Kind::INTEGER))
+        return typed->second.first;
+
+    return typed->first;
+}
+
+// The kind of the result of `opcode' applied to operands of kinds `a' (and
+// `b'). Mixing an integer with a float gives a float.
+static Kind result(OpCode opcode, Kind a, Kind b) {
+    switch (generic(opcode)) {
+        case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+            if (a == Kind::NONE || b == Kind::NONE)
+                return Kind::NONE;
+            if ((a == Kind::FLOAT && (b == Kind::FLOAT || integral(b))) || (b == Kind::FLOAT && integral(a)))
+                return Kind::FLOAT;
+            if (generic(opcode) == OpCode::DIV || !integral(a) || !integral(b))
+                return Kind::UNKNOWN;
+            if (a == Kind::INTEGER || b == Kind::INTEGER)
+                return Kind::INTEGER;
+            return a == Kind::BYTE && b == Kind::BYTE ? Kind::BYTE : Kind::INTEGRAL;
+        case OpCode::EQ: case OpCode::NE: case OpCode::LT: case OpCode::LE: case OpCode::GT: case OpCode::GE:
+        case OpCode::INT:
+            return Kind::INTEGER;
+        case OpCode::BYT:
+            return Kind::BYTE;
+        case OpCode::FLT: case OpCode::ATAN: case OpCode::COS: case OpCode::LOG:
+        case OpCode::SIN: case OpCode::SQR: case OpCode::TAN: case OpCode::EXP:
+            return Kind::FLOAT;
+        case OpCode::INCA: case OpCode::INCB: case OpCode::INCC:
+            return a == Kind::NONE || a == Kind::FLOAT || integral(a) ? a : Kind::UNKNOWN;
+        default:
+            return Kind::UNKNOWN;
+    }
+}
+
+// Variables are slots of the globals (region 0) or of the frame of the
+// function in a region. The compiler only addresses the frame inside a
+// function; a frame slot outside one is never typed.
+typedef std::pair<size_t, int32_t> Slot;
+
+static int32_t slotIndex(const AsmToken &token) {
+    if (token.isPointer())
+        return std::get<int32_t>(*token.arg);
+
+    if (token.isShort())
+        return std::get<int16_t>(*token.arg);
+
+    return (int16_t)(std::get<uint32_t>(*token.arg) & 0xFFFF);
+}
+
+// Where IDX points: outside every frame and global, at a known global, at a
+// known slot of the frame, or possibly anywhere in the frame
+struct Address {
+    enum { ABSOLUTE, GLOBAL, FRAME, ANYWHERE } kind;
+    int32_t offset;
+};
+
+struct Typing {
+    std::set<Slot> stored;
+    std::map<Slot, Kind> slots;
+    // The lowest slot of each region that may be written unseen
+    std::map<size_t, int32_t> clobbered;
+    std::vector<bool> framedExits;
+    bool collecting = true;
+    bool changed = false;
+};
+
+// Follows the kinds of A, B, C and the stack through a block, joining the
+// kind of every value stored into the slot it goes to, and when `rewrite' is
+// set gives each generic operation its typed form. IDX only addresses a
+// frame after MOVIDX, and a global after SETIDX, so the slot each indexed
+// store or datum then writes is followed too. Once such an address is lost
+// track of, every slot of its region from the address up is given up on, as
+// an array reached through it may cover them: when it becomes a value in a
+// register or a variable, as the pointer to an array the compiler places in
+// the frame does, or when it is left on the stack or in IDX at the end of
+// the block. An indexed store to an unknown slot of the frame gives up on
+// all of it. Returns whether IDX may still address the frame at the end of
+// the block.
+static bool typeBlock(BasicBlock &block, size_t region, bool framed, Typing &typing, bool rewrite, std::map<std::string, int> &hits) {
+    struct Entry {
+        Kind kind;
+        Address address;
+    };
+
+    const Address Absolute = { Address::ABSOLUTE, 0 };
+
+    std::map<Effect, Kind> reg = { {EFFECT_A, Kind::UNKNOWN}, {EFFECT_B, Kind::UNKNOWN}, {EFFECT_C, Kind::UNKNOWN} };
+    std::vector<Entry> stack;
+    Address idx = framed ? Address{ Address::ANYWHERE, 0 } : Absolute;
+
+    auto clobber = [&](size_t region, int32_t from) {
+        auto found = typing.clobbered.find(region);
+
+        if (found == typing.clobbered.end() || from < found->second) {
+            typing.clobbered[region] = from;
+            typing.changed = true;
+        }
+    };
+
+    auto lose = [&](const Address &address) {
+        if (address.kind == Address::GLOBAL)
+            clobber(0, address.offset);
+        else if (address.kind == Address::FRAME)
+            clobber(region, address.offset);
+        else if (address.kind == Address::ANYWHERE)
+            clobber(region, 0);
+    };
+
+    auto leaveStack = [&]() {
+        for (const auto &entry : stack)
+            lose(entry.address);
+
+        stack.clear();
+    };
+
+    auto slot = [&](bool frame, int32_t index) {
+        if (frame && !region)
+            clobber(region, 0);
+
+        return Slot(frame ? region : 0, index);
+    };
+
+    auto load = [&](const Slot &s) {
+        auto clobbered = typing.clobbered.find(s.first);
+
+        if (typing.collecting || (clobbered != typing.clobbered.end() && s.second >= clobbered->second) || !typing.stored.count(s))
+            return Kind::UNKNOWN;
+
+        auto found = typing.slots.find(s);
+
+        return found == typing.slots.end() ? Kind::NONE : found->second;
+    };
+
+    auto store = [&](const Slot &s, Kind kind) {
+        typing.stored.insert(s);
+
+        auto &entry = typing.slots[s];
+        auto joined = join(entry, kind);
+
+        if (joined != entry) {
+            entry = joined;
+            typing.changed = true;
+        }
+    };
+
+    for (auto &token : block.asmTokens) {
+        auto opcode = token.opcode;
+        auto reads = OpCodeReads(opcode);
+        auto writes = OpCodeWrites(opcode);
+        auto loaded = Loads.find(opcode);
+        auto stored = Stores.find(opcode);
+
+        if (loaded != Loads.end()) {
+            reg[loaded->second.reg] = load(slot(loaded->second.frame, slotIndex(token)));
+        } else if (stored != Stores.end()) {
+            store(slot(stored->second.frame, slotIndex(token)), reg[stored->second.reg]);
+        } else if (opcode == OpCode::SETA || opcode == OpCode::SETB || opcode == OpCode::SETC) {
+            reg[(Effect)writes] = constantKind(token);
+        } else if (opcode == OpCode::MOVCA || opcode == OpCode::MOVCB) {
+            reg[(Effect)writes] = reg[EFFECT_C];
+        } else if (opcode == OpCode::PUSHA || opcode == OpCode::PUSHB || opcode == OpCode::PUSHC) {
+            stack.push_back({ reg[(Effect)(reads & ~EFFECT_STACK)], Absolute });
+        } else if (opcode == OpCode::POPA || opcode == OpCode::POPB || opcode == OpCode::POPC) {
+            reg[(Effect)(writes & ~EFFECT_STACK)] = stack.size() ? stack.back().kind : Kind::UNKNOWN;
+
+            if (stack.size()) {
+                lose(stack.back().address);
+                stack.pop_back();
+            }
+        } else if (opcode == OpCode::PUSHIDX) {
+            stack.push_back({ Kind::UNKNOWN, idx });
+        } else if (opcode == OpCode::POPIDX) {
+            idx = stack.size() ? stack.back().address : Absolute;
+
+            if (stack.size())
+                stack.pop_back();
+        } else if (opcode == OpCode::MOVIDX) {
+            idx = { Address::FRAME, slotIndex(token) };
+        } else if (opcode == OpCode::SETIDX && token.isPointer()) {
+            idx = { Address::GLOBAL, slotIndex(token) };
+        } else if (opcode == OpCode::INCIDX) {
+            idx.offset += slotIndex(token);
+        } else if (IndexedStores.count(opcode)) {
+            if (idx.kind == Address::FRAME || idx.kind == Address::GLOBAL) {
+                store(slot(idx.kind == Address::FRAME, idx.offset), Kind::UNKNOWN);
+            } else if (idx.kind == Address::ANYWHERE) {
+                clobber(region, 0);
+            }
+        } else if (opcode == OpCode::SAVEIDX) {
+            lose(idx);
+            store(slot(false, slotIndex(token)), Kind::UNKNOWN);
+        } else if (opcode == OpCode::IDATA || opcode == OpCode::BDATA || opcode == OpCode::FDATA || opcode == OpCode::PDATA || opcode == OpCode::SDATA) {
+            auto count = opcode == OpCode::SDATA ? (int32_t)std::get<std::string>(*token.arg).size() + 1 : 1;
+
+            if (idx.kind == Address::FRAME || idx.kind == Address::GLOBAL) {
+                for (int32_t i = 0; i < count; i++)
+                    store(slot(idx.kind == Address::FRAME, idx.offset + i), Kind::UNKNOWN);
+            } else if (idx.kind == Address::ANYWHERE) {
+                clobber(region, 0);
+            }
+        } else {
+            if (rewrite && !typing.collecting) {
+                auto typed = specialised(opcode, reg[EFFECT_A], reg[EFFECT_B]);
+
+                if (typed != opcode) {
+                    token.opcode = typed;
+                    hits["typed-arithmetic"]++;
+                }
+            }
+
+            auto operand = reads & EFFECT_A ? EFFECT_A : reads & EFFECT_B ? EFFECT_B : EFFECT_C;
+            auto kind = result(opcode, reg[operand], reg[EFFECT_B]);
+
+            if (writes & EFFECT_IDX)
+                idx = Absolute;
+
+            if (writes & EFFECT_STACK)
+                leaveStack();
+
+            for (auto &entry : reg) {
+                if (writes & entry.first)
+                    entry.second = kind;
+            }
+        }
+    }
+
+    leaveStack();
+
+    if (idx.kind == Address::GLOBAL)
+        lose(idx);
+
+    return idx.kind == Address::FRAME || idx.kind == Address::ANYWHERE;
+}
+
+bool specialise(std::vector<AsmToken> &asmTokens, const FunctionLabels &functions, std::map<std::string, int> &hits) {
+    ControlFlowGraph cfg(asmTokens);
+
+    // A function's region runs from its entry to its end label, or to the
+    // next function when jump threading has dropped the end label
+    std::map<std::string, std::string> ends(functions.begin(), functions.end());
+    std::vector<size_t> regions(cfg.size(), 0);
+    std::string end;
+    size_t region = 0;
+
+    for (size_t i = 0; i < cfg.size(); i++) {
+        auto label = cfg[i].label();
+
+        if (end.size() && label == end)
+            end.clear();
+
+        auto entry = ends.find(label);
+
+        if (label.size() && entry != ends.end()) {
+            end = entry->second;
+            region++;
+        }
+
+        regions[i] = end.size() ? region : 0;
+    }
+
+    Typing typing;
+    typing.framedExits.assign(cfg.size(), false);
+
+    auto pass = [&](bool rewrite) {
+        for (size_t i = 0; i < cfg.size(); i++) {
+            const auto &predecessors = cfg[i].predecessors;
+            auto framed = std::any_of(predecessors.begin(), predecessors.end(), [&](size_t p) { return typing.framedExits[p]; });
+
+            if (typeBlock(cfg[i], regions[i], framed, typing, rewrite, hits) && !typing.framedExits[i]) {
+                typing.framedExits[i] = true;
+                typing.changed = true;
+            }
+        }
+    };
+
+    // The first passes find every slot stored to and where IDX may address
+    // a frame, the rest the kinds of the slots
+    do {
+        typing.changed = false;
+        pass(false);
+    } while (typing.changed);
+
+    // Kinds joined while every load was unknown say nothing
+    typing.slots.clear();
+    typing.collecting = false;
+
+    do {
+        typing.changed = false;
+        pass(false);
+    } while (typing.changed);
+
+    auto before = hits["typed-arithmetic"];
+
+    pass(true);
+
+    asmTokens = cfg.linearise();
+
+    return hits["typed-arithmetic"] != before;
+}
@@ -0,0 +1,60 @@
+#ifndef __FLOW_H__
+#define __FLOW_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <optional>
+#include <functional>
+
+#include "Assembly.h"
+
+struct BasicBlock {
+    std::vector<AsmToken> asmTokens;
+    std::vector<size_t> successors;
+    std::vector<size_t> predecessors;
+
+    std::string label() const;
+    const AsmToken &terminator() const;
+};
+
+class ControlFlowGraph {
+    std::vector<BasicBlock> blocks;
+    std::map<std::string, size_t> labels;
+
+    void link(size_t from, size_t to);
+public:
+    ControlFlowGraph(const std::vector<AsmToken> &asmTokens);
+
+    size_t size() const {
+        return blocks.size();
+    }
+
+    BasicBlock &operator[](size_t i) {
+        return blocks[i];
+    }
+
+    const BasicBlock &operator[](size_t i) const {
+        return blocks[i];
+    }
+
+    std::vector<bool> reachable() const;
+    std::vector<AsmToken> linearise(const std::vector<bool> &keep) const;
+    std::vector<AsmToken> linearise() const;
+};
+
+bool removeUnreachable(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits);
+bool forwardMemory(std::vector<AsmToken> &asmTokens, std::map<std::string, int> &hits);
+bool specialise(std::vector<AsmToken> &asmTokens, const FunctionLabels &functions, std::map<std::string, int> &hits);
+
+// Returns the store and the load of a fresh temporary to hold a hoisted or
+// reused value, or nothing when no slot is left
+typedef std::function<std::optional<std::pair<AsmToken, AsmToken>>()> Temporary;
+
+std::vector<AsmToken> hoistInvariants(std::vector<AsmToken> &loop, const Temporary &temporary);
+
+// Reuses values already computed in the same block. `separate' says frame
+// and absolute locations cannot alias, as in a function's own frame.
+void numberValues(std::vector<AsmToken> &asmTokens, bool separate, const Temporary &temporary);
+
+#endif //__FLOW_H__
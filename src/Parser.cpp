@@ -155,6 +155,10 @@ std::vector<Token> parse(const std::string &source) {
                     }
                     break;
                 case 'c':
+                    if (keyword == "case") {
+                        tokenType = TokenType::CASE;
+                    }
+                    else
                     if (keyword == "chr") {
                         tokenType = TokenType::BUILTIN;
                     }
@@ -180,6 +184,10 @@ std::vector<Token> parse(const std::string &source) {
                         tokenType = TokenType::DEF;
                     }
                     else
+                    if (keyword == "default") {
+                        tokenType = TokenType::DEFAULT;
+                    }
+                    else
                     if (keyword == "drawbox") {
                         tokenType = TokenType::BUILTIN;
                     }
@@ -340,6 +348,10 @@ std::vector<Token> parse(const std::string &source) {
                     if (keyword == "substr") {
                         tokenType = TokenType::BUILTIN;
                     }
+                    else
+                    if (keyword == "switch") {
+                        tokenType = TokenType::SWITCH;
+                    }
                     break;
                 case 't':
                     if (keyword == "tan") {
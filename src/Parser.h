@@ -135,8 +135,10 @@ enum class TokenType {
     BYTE,
 
     BREAK,
+    CASE,
     CONTINUE,
     DEF,
+    DEFAULT,
     ELSE,
     FOR,
     IF,
@@ -144,6 +146,7 @@ enum class TokenType {
     SIZEOF,
     SLOT,
     STRUCT,
+    SWITCH,
     VAR,
     VAL,
     WHILE,
@@ -101,6 +101,34 @@ std::string OpCodeAsString(OpCode opcode) {
         case OpCode::COPY: return "COPY";
         case OpCode::YIELD: return "YIELD";
         case OpCode::TRACE: return "TRACE";
+        case OpCode::JMPEQ: return "JMPEQ";
+        case OpCode::JMPNE: return "JMPNE";
+        case OpCode::JMPLT: return "JMPLT";
+        case OpCode::JMPLE: return "JMPLE";
+        case OpCode::JMPGT: return "JMPGT";
+        case OpCode::JMPGE: return "JMPGE";
+        case OpCode::STRLEN: return "STRLEN";
+        case OpCode::STRCMP: return "STRCMP";
+        case OpCode::JMPIDX: return "JMPIDX";
+        case OpCode::ADDI: return "ADDI";
+        case OpCode::SUBI: return "SUBI";
+        case OpCode::MULI: return "MULI";
+        case OpCode::EQI: return "EQI";
+        case OpCode::NEI: return "NEI";
+        case OpCode::LTI: return "LTI";
+        case OpCode::LEI: return "LEI";
+        case OpCode::GTI: return "GTI";
+        case OpCode::GEI: return "GEI";
+        case OpCode::ADDF: return "ADDF";
+        case OpCode::SUBF: return "SUBF";
+        case OpCode::MULF: return "MULF";
+        case OpCode::EQF: return "EQF";
+        case OpCode::NEF: return "NEF";
+        case OpCode::LTF: return "LTF";
+        case OpCode::LEF: return "LEF";
+        case OpCode::GTF: return "GTF";
+        case OpCode::GEF: return "GEF";
+        case OpCode::BDATA: return "BDATA";
         default: return "????";
     }
 }
@@ -234,7 +262,158 @@ std::map<std::string, std::pair<OpCode, ArgType>> OpCodeDefinition = {
 
     {"YIELD", {OpCode::YIELD, ArgType::NONE}},
 
-    {"TRACE", {OpCode::TRACE, ArgType::INT}}
+    {"TRACE", {OpCode::TRACE, ArgType::INT}},
+
+    {"JMPEQ", {OpCode::JMPEQ, ArgType::LABEL}},
+    {"JMPNE", {OpCode::JMPNE, ArgType::LABEL}},
+    {"JMPLT", {OpCode::JMPLT, ArgType::LABEL}},
+    {"JMPLE", {OpCode::JMPLE, ArgType::LABEL}},
+    {"JMPGT", {OpCode::JMPGT, ArgType::LABEL}},
+    {"JMPGE", {OpCode::JMPGE, ArgType::LABEL}},
+    {"STRLEN", {OpCode::STRLEN, ArgType::NONE}},
+    {"STRCMP", {OpCode::STRCMP, ArgType::NONE}},
+    {"JMPIDX", {OpCode::JMPIDX, ArgType::INT}},
+
+    {"ADDI", {OpCode::ADDI, ArgType::NONE}},
+    {"SUBI", {OpCode::SUBI, ArgType::NONE}},
+    {"MULI", {OpCode::MULI, ArgType::NONE}},
+    {"EQI", {OpCode::EQI, ArgType::NONE}},
+    {"NEI", {OpCode::NEI, ArgType::NONE}},
+    {"LTI", {OpCode::LTI, ArgType::NONE}},
+    {"LEI", {OpCode::LEI, ArgType::NONE}},
+    {"GTI", {OpCode::GTI, ArgType::NONE}},
+    {"GEI", {OpCode::GEI, ArgType::NONE}},
+
+    {"ADDF", {OpCode::ADDF, ArgType::NONE}},
+    {"SUBF", {OpCode::SUBF, ArgType::NONE}},
+    {"MULF", {OpCode::MULF, ArgType::NONE}},
+    {"EQF", {OpCode::EQF, ArgType::NONE}},
+    {"NEF", {OpCode::NEF, ArgType::NONE}},
+    {"LTF", {OpCode::LTF, ArgType::NONE}},
+    {"LEF", {OpCode::LEF, ArgType::NONE}},
+    {"GTF", {OpCode::GTF, ArgType::NONE}},
+    {"GEF", {OpCode::GEF, ArgType::NONE}},
+    {"BDATA", {OpCode::BDATA, ArgType::INT}}
 };
 
 
+
+bool OpCodeIsJump(OpCode opcode) {
+    switch(opcode) {
+        case OpCode::JMP: case OpCode::JMPEZ: case OpCode::JMPNZ:
+        case OpCode::JMPEQ: case OpCode::JMPNE: case OpCode::JMPLT: case OpCode::JMPLE: case OpCode::JMPGT: case OpCode::JMPGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+uint32_t OpCodeReads(OpCode opcode) {
+    switch(opcode) {
+        case OpCode::NOP: return EFFECT_NONE;
+        case OpCode::SETA: case OpCode::SETB: case OpCode::SETC: return EFFECT_NONE;
+        case OpCode::LOADA: case OpCode::LOADB: case OpCode::LOADC: return EFFECT_MEMORY;
+        case OpCode::STOREA: return EFFECT_A;
+        case OpCode::STOREB: return EFFECT_B;
+        case OpCode::STOREC: return EFFECT_C;
+        case OpCode::READA: case OpCode::READB: case OpCode::READC: return EFFECT_MEMORY;
+        case OpCode::WRITEA: return EFFECT_A;
+        case OpCode::WRITEB: return EFFECT_B;
+        case OpCode::WRITEC: return EFFECT_C;
+        case OpCode::PUSHA: return EFFECT_A|EFFECT_STACK;
+        case OpCode::PUSHB: return EFFECT_B|EFFECT_STACK;
+        case OpCode::PUSHC: return EFFECT_C|EFFECT_STACK;
+        case OpCode::POPA: case OpCode::POPB: case OpCode::POPC: return EFFECT_STACK;
+        case OpCode::MOVCA: case OpCode::MOVCB: case OpCode::MOVCIDX: return EFFECT_C;
+        case OpCode::INCA: return EFFECT_A;
+        case OpCode::INCB: return EFFECT_B;
+        case OpCode::INCC: return EFFECT_C;
+        case OpCode::IDXA: case OpCode::IDXB: case OpCode::IDXC: return EFFECT_IDX|EFFECT_MEMORY;
+        case OpCode::WRITEAX: return EFFECT_A|EFFECT_IDX;
+        case OpCode::WRITEBX: return EFFECT_B|EFFECT_IDX;
+        case OpCode::WRITECX: return EFFECT_C|EFFECT_IDX;
+        case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+        case OpCode::IDIV: case OpCode::MOD: case OpCode::POW:
+        case OpCode::LSHIFT: case OpCode::RSHIFT: case OpCode::BAND: case OpCode::BOR: case OpCode::XOR:
+        case OpCode::AND: case OpCode::OR:
+        case OpCode::EQ: case OpCode::NE: case OpCode::GT: case OpCode::GE: case OpCode::LT: case OpCode::LE: case OpCode::CMP:
+        case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI:
+        case OpCode::EQI: case OpCode::NEI: case OpCode::LTI: case OpCode::LEI: case OpCode::GTI: case OpCode::GEI:
+        case OpCode::ADDF: case OpCode::SUBF: case OpCode::MULF:
+        case OpCode::EQF: case OpCode::NEF: case OpCode::LTF: case OpCode::LEF: case OpCode::GTF: case OpCode::GEF:
+            return EFFECT_A|EFFECT_B;
+        case OpCode::EXP: case OpCode::BNOT: case OpCode::NOT:
+        case OpCode::ATAN: case OpCode::COS: case OpCode::LOG: case OpCode::SIN: case OpCode::SQR: case OpCode::TAN:
+        case OpCode::RND: case OpCode::SEED:
+        case OpCode::BYT: case OpCode::FLT: case OpCode::INT: case OpCode::PTR:
+            return EFFECT_C;
+        case OpCode::SETIDX: case OpCode::MOVIDX: return EFFECT_NONE;
+        case OpCode::LOADIDX: return EFFECT_MEMORY;
+        case OpCode::INCIDX: case OpCode::SAVEIDX: return EFFECT_IDX;
+        case OpCode::PUSHIDX: return EFFECT_IDX|EFFECT_STACK;
+        case OpCode::POPIDX: return EFFECT_STACK;
+        case OpCode::JMP: return EFFECT_CONTROL;
+        case OpCode::JMPEZ: case OpCode::JMPNZ: return EFFECT_C|EFFECT_CONTROL;
+        case OpCode::JMPEQ: case OpCode::JMPNE: case OpCode::JMPLT: case OpCode::JMPLE: case OpCode::JMPGT: case OpCode::JMPGE:
+            return EFFECT_A|EFFECT_B|EFFECT_CONTROL;
+        case OpCode::JMPIDX: return EFFECT_C|EFFECT_CONTROL;
+        case OpCode::IDATA: case OpCode::FDATA: case OpCode::PDATA: case OpCode::SDATA: case OpCode::BDATA: return EFFECT_IDX;
+        case OpCode::ALLOC: return EFFECT_MEMORY;
+        case OpCode::CALLOC: return EFFECT_C|EFFECT_MEMORY;
+        case OpCode::FREE: return EFFECT_MEMORY;
+        case OpCode::FREEIDX: return EFFECT_IDX|EFFECT_MEMORY;
+        case OpCode::COPY: return EFFECT_A|EFFECT_B|EFFECT_C|EFFECT_MEMORY;
+        case OpCode::STRLEN: return EFFECT_IDX|EFFECT_MEMORY;
+        case OpCode::STRCMP: return EFFECT_A|EFFECT_B|EFFECT_MEMORY;
+        // The runtime routines hand their results back in IDX
+        case OpCode::RETURN: return EFFECT_IDX|EFFECT_STACK|EFFECT_CONTROL;
+        default: return EFFECT_ALL;
+    }
+}
+
+uint32_t OpCodeWrites(OpCode opcode) {
+    switch(opcode) {
+        case OpCode::NOP: return EFFECT_NONE;
+        case OpCode::SETA: case OpCode::LOADA: case OpCode::READA: case OpCode::MOVCA: case OpCode::INCA: case OpCode::IDXA: return EFFECT_A;
+        case OpCode::SETB: case OpCode::LOADB: case OpCode::READB: case OpCode::MOVCB: case OpCode::INCB: case OpCode::IDXB: return EFFECT_B;
+        case OpCode::SETC: case OpCode::LOADC: case OpCode::READC: case OpCode::INCC: case OpCode::IDXC: return EFFECT_C;
+        case OpCode::STOREA: case OpCode::STOREB: case OpCode::STOREC:
+        case OpCode::WRITEA: case OpCode::WRITEB: case OpCode::WRITEC:
+        case OpCode::WRITEAX: case OpCode::WRITEBX: case OpCode::WRITECX:
+            return EFFECT_MEMORY;
+        case OpCode::PUSHA: case OpCode::PUSHB: case OpCode::PUSHC: case OpCode::PUSHIDX: return EFFECT_STACK;
+        case OpCode::POPA: return EFFECT_A|EFFECT_STACK;
+        case OpCode::POPB: return EFFECT_B|EFFECT_STACK;
+        case OpCode::POPC: return EFFECT_C|EFFECT_STACK;
+        case OpCode::MOVCIDX: return EFFECT_IDX;
+        case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+        case OpCode::IDIV: case OpCode::MOD: case OpCode::POW: case OpCode::EXP:
+        case OpCode::LSHIFT: case OpCode::RSHIFT: case OpCode::BNOT: case OpCode::BAND: case OpCode::BOR: case OpCode::XOR:
+        case OpCode::ATAN: case OpCode::COS: case OpCode::LOG: case OpCode::SIN: case OpCode::SQR: case OpCode::TAN:
+        case OpCode::RND:
+        case OpCode::BYT: case OpCode::FLT: case OpCode::INT: case OpCode::PTR:
+        case OpCode::AND: case OpCode::OR: case OpCode::NOT:
+        case OpCode::EQ: case OpCode::NE: case OpCode::GT: case OpCode::GE: case OpCode::LT: case OpCode::LE: case OpCode::CMP:
+        case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI:
+        case OpCode::EQI: case OpCode::NEI: case OpCode::LTI: case OpCode::LEI: case OpCode::GTI: case OpCode::GEI:
+        case OpCode::ADDF: case OpCode::SUBF: case OpCode::MULF:
+        case OpCode::EQF: case OpCode::NEF: case OpCode::LTF: case OpCode::LEF: case OpCode::GTF: case OpCode::GEF:
+            return EFFECT_C;
+        case OpCode::SEED: return EFFECT_NONE;
+        case OpCode::SETIDX: case OpCode::MOVIDX: case OpCode::LOADIDX: case OpCode::INCIDX: return EFFECT_IDX;
+        case OpCode::SAVEIDX: return EFFECT_MEMORY;
+        case OpCode::POPIDX: return EFFECT_IDX|EFFECT_STACK;
+        case OpCode::JMP: case OpCode::JMPEZ: case OpCode::JMPNZ: return EFFECT_CONTROL;
+        case OpCode::JMPEQ: case OpCode::JMPNE: case OpCode::JMPLT: case OpCode::JMPLE: case OpCode::JMPGT: case OpCode::JMPGE:
+            return EFFECT_CONTROL;
+        case OpCode::JMPIDX: return EFFECT_CONTROL;
+        case OpCode::IDATA: case OpCode::FDATA: case OpCode::PDATA: case OpCode::SDATA: case OpCode::BDATA: return EFFECT_MEMORY;
+        case OpCode::ALLOC: case OpCode::CALLOC: return EFFECT_IDX|EFFECT_MEMORY;
+        case OpCode::FREE: case OpCode::FREEIDX: case OpCode::COPY: return EFFECT_MEMORY;
+        case OpCode::STRLEN: case OpCode::STRCMP: return EFFECT_C;
+        // Control goes back to the caller, which assumes nothing about what
+        // is left in A, B or C after the call
+        case OpCode::RETURN: return EFFECT_A|EFFECT_B|EFFECT_C|EFFECT_STACK|EFFECT_CONTROL;
+        default: return EFFECT_ALL;
+    }
+}
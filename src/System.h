@@ -136,6 +136,46 @@ enum class OpCode {
 
     TRACE,
 
+    JMPEQ,
+    JMPNE,
+    JMPLT,
+    JMPLE,
+    JMPGT,
+    JMPGE,
+    JMPIDX,
+
+    // Block string operations. STRLEN leaves the length of the string at IDX
+    // in C; STRCMP compares the strings at A and B and leaves -1, 0 or 1 in
+    // C.
+    STRLEN,
+    STRCMP,
+
+    // ADD, SUB, MUL and the comparisons for operands whose type is known.
+    // The I forms take integers and give an integer, never a byte; the F
+    // forms take floats.
+    ADDI,
+    SUBI,
+    MULI,
+    EQI,
+    NEI,
+    LTI,
+    LEI,
+    GTI,
+    GEI,
+
+    ADDF,
+    SUBF,
+    MULF,
+    EQF,
+    NEF,
+    LTF,
+    LEF,
+    GTF,
+    GEF,
+
+    // IDATA for a byte
+    BDATA,
+
     COUNT
 };
 
@@ -181,8 +221,24 @@ enum class ArgType {
     COUNT
 };
 
+enum Effect {
+    EFFECT_NONE = 0,
+    EFFECT_A = 1 << 0,
+    EFFECT_B = 1 << 1,
+    EFFECT_C = 1 << 2,
+    EFFECT_IDX = 1 << 3,
+    EFFECT_STACK = 1 << 4,
+    EFFECT_MEMORY = 1 << 5,
+    EFFECT_CONTROL = 1 << 6,
+    EFFECT_ALL = 0x7F
+};
+
 std::string OpCodeAsString(OpCode opcode);
 
+bool OpCodeIsJump(OpCode opcode);
+uint32_t OpCodeReads(OpCode opcode);
+uint32_t OpCodeWrites(OpCode opcode);
+
 extern std::map<std::string, std::pair<OpCode, ArgType>> OpCodeDefinition;
 
 #endif //__SYSTEM_H__
@@ -55,6 +55,24 @@ int main(int argc, char **argv) {
         "-O"     // Flag token.
     );
 
+    opt.add(
+        "96", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "inline functions of up to ARG instructions when optimising", // Help description.
+        "-i"     // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        0, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "print how often each optimisation rule fired", // Help description.
+        "-v"     // Flag token.
+    );
+
     opt.parse(argc, (const char**)argv);
 
     if (opt.isSet("-h")) {
@@ -78,10 +96,27 @@ int main(int argc, char **argv) {
     buffer << infile.rdbuf();
 
     auto tokens = parse(buffer.str());
-    auto asmTokens = compile(cpu, tokens);
+    int inlineLimit;
+    opt.get("-i")->getInt(inlineLimit);
+
+    if (inlineLimit < 0) {
+        std::cerr << "Inline limit must not be negative" << std::endl;
+        exit(-1);
+    }
+
+    FunctionLabels functions;
+    auto asmTokens = compile(cpu, tokens, opt.isSet("-O"), inlineLimit, &functions);
 
     if (opt.isSet("-O")) {
-        asmTokens = optimise(cpu, asmTokens);
+        std::map<std::string, int> hits;
+
+        asmTokens = optimise(cpu, asmTokens, hits, functions);
+
+        if (opt.isSet("-v")) {
+            for (const auto &hit : hits) {
+                std::cerr << "optimise: " << hit.first << " " << hit.second << std::endl;
+            }
+        }
     }
 
     if (opt.isSet("-s")) {
@@ -0,0 +1,563 @@
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+
+#include <iostream>
+
+#include "ezOptionParser.hpp"
+
+#include "System.h"
+
+// Step counter. Runs an object file on a model of the VM and reports how
+// many instructions it executed and how large its code is, so that two
+// builds of the same program can be compared. System calls are stubbed:
+// input is canned and output is only logged, one line per call, so the logs
+// of two builds can be diffed as well. It is not a replacement for the VM
+// and says nothing about timing.
+
+struct Value {
+    enum class Kind {
+        INTEGER,
+        BYTE,
+        FLOAT,
+        POINTER
+    };
+
+    Kind kind = Kind::INTEGER;
+    int32_t i = 0;
+    float f = 0;
+
+    double number() const {
+        return kind == Kind::FLOAT ? f : i;
+    }
+
+    static Value Integer(int32_t i) {
+        Value v;
+        v.i = (int16_t)i;
+        return v;
+    }
+
+    static Value Byte(int32_t i) {
+        Value v;
+        v.kind = Kind::BYTE;
+        v.i = i;
+        return v;
+    }
+
+    static Value Float(float f) {
+        Value v;
+        v.kind = Kind::FLOAT;
+        v.f = f;
+        return v;
+    }
+
+    static Value Pointer(int32_t p) {
+        Value v;
+        v.kind = Kind::POINTER;
+        v.i = p;
+        return v;
+    }
+
+    // The encoding written by Int16AsValue, ByteAsValue and addPointer
+    static Value decode(uint32_t raw) {
+        const uint32_t SIGN = 0x80000000;
+        const uint32_t QNAN = 0x7F800000;
+        const uint32_t BYTE_BIT = 0x00010000;
+
+        if ((raw & (QNAN|SIGN)) == (QNAN|SIGN))
+            return Pointer(raw & 0x7FFFFF);
+
+        if ((raw & (QNAN|SIGN)) == QNAN)
+            return (raw & BYTE_BIT) ? Byte((int16_t)(raw & 0xFFFF)) : Integer(raw & 0xFFFF);
+
+        float f;
+        memcpy(&f, &raw, sizeof(f));
+        return Float(f);
+    }
+
+    std::string toString() const {
+        std::ostringstream s;
+
+        switch (kind) {
+            case Kind::INTEGER: s << "i" << i; break;
+            case Kind::BYTE: s << "b" << i; break;
+            case Kind::FLOAT: s << "f" << f; break;
+            case Kind::POINTER: s << "p" << i; break;
+        }
+
+        return s.str();
+    }
+};
+
+static Value arithmetic(OpCode opcode, const Value &a, const Value &b) {
+    bool real = a.kind == Value::Kind::FLOAT || b.kind == Value::Kind::FLOAT;
+    double x = a.number(), y = b.number();
+    int32_t l = (int32_t)x, r = (int32_t)y;
+
+    switch (opcode) {
+        case OpCode::ADD: case OpCode::ADDI: case OpCode::ADDF:
+        case OpCode::SUB: case OpCode::SUBI: case OpCode::SUBF:
+        case OpCode::MUL: case OpCode::MULI: case OpCode::MULF: {
+            double result = x * y;
+
+            if (opcode == OpCode::ADD || opcode == OpCode::ADDI || opcode == OpCode::ADDF)
+                result = x + y;
+            else if (opcode == OpCode::SUB || opcode == OpCode::SUBI || opcode == OpCode::SUBF)
+                result = x - y;
+
+            if (real)
+                return Value::Float(result);
+            if (a.kind == Value::Kind::POINTER || b.kind == Value::Kind::POINTER)
+                return Value::Pointer(result);
+            if (a.kind == Value::Kind::BYTE && b.kind == Value::Kind::BYTE && opcode != OpCode::ADDI && opcode != OpCode::SUBI && opcode != OpCode::MULI)
+                return Value::Byte((int16_t)result);
+            return Value::Integer(result);
+        }
+        case OpCode::DIV: return Value::Float(y == 0 ? 0 : x / y);
+        case OpCode::IDIV: return Value::Integer(r == 0 ? 0 : l / r);
+        case OpCode::MOD: return real ? Value::Float(y == 0 ? 0 : std::fmod(x, y)) : Value::Integer(r == 0 ? 0 : l % r);
+        case OpCode::POW: return Value::Float(std::pow(x, y));
+        case OpCode::LSHIFT: return Value::Integer(l << (r & 15));
+        case OpCode::RSHIFT: return Value::Integer(l >> (r & 15));
+        case OpCode::BAND: return Value::Integer(l & r);
+        case OpCode::BOR: return Value::Integer(l | r);
+        case OpCode::XOR: return Value::Integer(l ^ r);
+        case OpCode::AND: return Value::Integer(x != 0 && y != 0);
+        case OpCode::OR: return Value::Integer(x != 0 || y != 0);
+        case OpCode::EQ: case OpCode::EQI: case OpCode::EQF: return Value::Integer(x == y);
+        case OpCode::NE: case OpCode::NEI: case OpCode::NEF: return Value::Integer(x != y);
+        case OpCode::LT: case OpCode::LTI: case OpCode::LTF: return Value::Integer(x < y);
+        case OpCode::LE: case OpCode::LEI: case OpCode::LEF: return Value::Integer(x <= y);
+        case OpCode::GT: case OpCode::GTI: case OpCode::GTF: return Value::Integer(x > y);
+        case OpCode::GE: case OpCode::GEI: case OpCode::GEF: return Value::Integer(x >= y);
+        default: return Value();
+    }
+}
+
+// The typed opcodes skip the VM's tag checks, so the compiler must only use
+// them on operands of the kind they assume
+static bool checked(OpCode opcode, const Value &a, const Value &b) {
+    auto integral = [](const Value &v) { return v.kind == Value::Kind::INTEGER || v.kind == Value::Kind::BYTE; };
+
+    switch (opcode) {
+        case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI:
+        case OpCode::EQI: case OpCode::NEI: case OpCode::LTI: case OpCode::LEI: case OpCode::GTI: case OpCode::GEI:
+            return integral(a) && integral(b);
+        case OpCode::ADDF: case OpCode::SUBF: case OpCode::MULF:
+        case OpCode::EQF: case OpCode::NEF: case OpCode::LTF: case OpCode::LEF: case OpCode::GTF: case OpCode::GEF:
+            return a.kind == Value::Kind::FLOAT && b.kind == Value::Kind::FLOAT;
+        default:
+            return true;
+    }
+}
+
+class Machine {
+    private:
+        const std::vector<uint8_t> code;
+        std::map<uint8_t, ArgType> argTypes;
+
+        std::vector<Value> memory;
+        std::vector<Value> stack;
+        std::vector<std::pair<uint32_t, int32_t>> frames;
+
+        Value a, b, c;
+        int32_t idx = 0;
+        int32_t frame;
+        int32_t heap;
+        std::map<int32_t, int32_t> blocks;
+
+        uint32_t pc = 0;
+        uint32_t seed = 1;
+
+        void fail(uint32_t at, const std::string &message) {
+            std::cerr << "stepcount: " << message << " at " << at << std::endl;
+            exit(-1);
+        }
+
+        Value pop(uint32_t at) {
+            if (stack.empty())
+                fail(at, "Stack underflow");
+
+            auto value = stack.back();
+            stack.pop_back();
+            return value;
+        }
+
+        std::string string(int32_t address) const {
+            std::string s;
+
+            while (memory[address].number() != 0)
+                s += (char)memory[address++].i;
+
+            return s;
+        }
+
+        void syscall(SysCall call, std::ostream &log) {
+            log << "SYSCALL " << (int)call;
+
+            switch (call) {
+                case SysCall::WRITE:
+                    log << " '" << string(c.i) << "'";
+                    break;
+                case SysCall::READ:
+                    for (int i = 0; i < 4; i++)
+                        memory[idx + i] = Value::Byte("xyz"[i]);
+                    break;
+                case SysCall::READKEY:
+                    c = Value::Integer('a' + syscalls % 26);
+                    break;
+                case SysCall::KEYSET:
+                    c = Value::Integer((int32_t)((syscalls / 7) % 5) == (int32_t)c.number() % 5);
+                    break;
+                case SysCall::CLOCK:
+                    c = Value::Integer(syscalls);
+                    break;
+                case SysCall::MOUSE:
+                    a = Value::Integer(1);
+                    b = Value::Integer(2);
+                    c = Value::Integer(3);
+                    break;
+                case SysCall::DRAWBOX: case SysCall::DRAWLINE: case SysCall::VOICE:
+                    for (int i = 0; i < (call == SysCall::DRAWLINE ? 5 : 6); i++)
+                        log << " " << memory[idx + i].toString();
+                    break;
+                default:
+                    log << " " << a.toString() << " " << b.toString() << " " << c.toString();
+                    break;
+            }
+
+            log << std::endl;
+            syscalls++;
+        }
+
+    public:
+        uint64_t steps = 0;
+        uint64_t syscalls = 0;
+
+        Machine(const std::vector<uint8_t> &code) : code(code), memory(1 << 21), frame(1 << 20), heap(1 << 18) {
+            for (const auto &definition : OpCodeDefinition)
+                argTypes[(uint8_t)definition.second.first] = definition.second.second;
+        }
+
+        size_t size() const {
+            return code.size();
+        }
+
+        size_t stackDepth() const {
+            return stack.size();
+        }
+
+        size_t liveBlocks() const {
+            return blocks.size();
+        }
+
+        void run(uint64_t maxSyscalls, uint64_t maxSteps, std::ostream &log) {
+            while (pc < code.size() && syscalls < maxSyscalls && steps < maxSteps) {
+                auto at = pc;
+                auto opcode = (OpCode)code[pc++];
+
+                auto argType = argTypes.find((uint8_t)opcode);
+                if (argType == argTypes.end())
+                    fail(at, "Unknown opcode " + std::to_string((int)opcode));
+
+                uint32_t raw = 0;
+                int16_t arg = 0;
+                uint16_t call = 0;
+                std::string text;
+
+                switch (argType->second) {
+                    case ArgType::INT: case ArgType::LABEL:
+                        memcpy(&arg, &code[pc], 2);
+                        pc += 2;
+                        break;
+                    case ArgType::FLOAT: case ArgType::POINTER: case ArgType::VALUE:
+                        memcpy(&raw, &code[pc], 4);
+                        pc += 4;
+                        break;
+                    case ArgType::STRING:
+                        while (code[pc])
+                            text += (char)code[pc++];
+                        pc++;
+                        break;
+                    case ArgType::SYSCALL:
+                        memcpy(&call, &code[pc], 2);
+                        pc += 4;
+                        break;
+                    default:
+                        break;
+                }
+
+                auto value = Value::decode(raw);
+                int32_t address = raw & 0x7FFFFF;
+                uint16_t target = arg;
+
+                steps++;
+
+                switch (opcode) {
+                    case OpCode::NOP: case OpCode::TRACE: case OpCode::FREE: break;
+                    case OpCode::HALT: pc = code.size(); break;
+
+                    case OpCode::SETA: a = value; break;
+                    case OpCode::SETB: b = value; break;
+                    case OpCode::SETC: c = value; break;
+                    case OpCode::LOADA: a = memory[address]; break;
+                    case OpCode::LOADB: b = memory[address]; break;
+                    case OpCode::LOADC: c = memory[address]; break;
+                    case OpCode::STOREA: memory[address] = a; break;
+                    case OpCode::STOREB: memory[address] = b; break;
+                    case OpCode::STOREC: memory[address] = c; break;
+                    case OpCode::READA: a = memory[frame + value.i]; break;
+                    case OpCode::READB: b = memory[frame + value.i]; break;
+                    case OpCode::READC: c = memory[frame + value.i]; break;
+                    case OpCode::WRITEA: memory[frame + value.i] = a; break;
+                    case OpCode::WRITEB: memory[frame + value.i] = b; break;
+                    case OpCode::WRITEC: memory[frame + value.i] = c; break;
+                    case OpCode::PUSHA: stack.push_back(a); break;
+                    case OpCode::PUSHB: stack.push_back(b); break;
+                    case OpCode::PUSHC: stack.push_back(c); break;
+                    case OpCode::POPA: a = pop(at); break;
+                    case OpCode::POPB: b = pop(at); break;
+                    case OpCode::POPC: c = pop(at); break;
+                    case OpCode::MOVCA: a = c; break;
+                    case OpCode::MOVCB: b = c; break;
+                    case OpCode::MOVCIDX: idx = c.i; break;
+                    case OpCode::INCA: a = arithmetic(OpCode::ADD, a, value); break;
+                    case OpCode::INCB: b = arithmetic(OpCode::ADD, b, value); break;
+                    case OpCode::INCC: {
+                        auto kind = c.kind;
+                        c = arithmetic(OpCode::ADD, c, value);
+                        if (kind != Value::Kind::FLOAT)
+                            c.kind = kind;
+                        break;
+                    }
+                    case OpCode::IDXA: a = memory[idx]; break;
+                    case OpCode::IDXB: b = memory[idx]; break;
+                    case OpCode::IDXC: c = memory[idx]; break;
+                    case OpCode::WRITEAX: memory[idx] = a; break;
+                    case OpCode::WRITEBX: memory[idx] = b; break;
+                    case OpCode::WRITECX: memory[idx] = c; break;
+
+                    case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+                    case OpCode::IDIV: case OpCode::MOD: case OpCode::POW:
+                    case OpCode::LSHIFT: case OpCode::RSHIFT: case OpCode::BAND: case OpCode::BOR: case OpCode::XOR:
+                    case OpCode::AND: case OpCode::OR:
+                    case OpCode::EQ: case OpCode::NE: case OpCode::GT: case OpCode::GE: case OpCode::LT: case OpCode::LE:
+                    case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI:
+                    case OpCode::EQI: case OpCode::NEI: case OpCode::LTI: case OpCode::LEI: case OpCode::GTI: case OpCode::GEI:
+                    case OpCode::ADDF: case OpCode::SUBF: case OpCode::MULF:
+                    case OpCode::EQF: case OpCode::NEF: case OpCode::LTF: case OpCode::LEF: case OpCode::GTF: case OpCode::GEF:
+                        if (!checked(opcode, a, b))
+                            fail(at, OpCodeAsString(opcode) + " on " + a.toString() + " and " + b.toString());
+
+                        c = arithmetic(opcode, a, b);
+                        break;
+                    case OpCode::CMP: {
+                        // Pointers are compared by what they point at, as
+                        // strcmp expects
+                        double x = a.kind == Value::Kind::POINTER ? memory[a.i].number() : a.number();
+                        double y = b.kind == Value::Kind::POINTER ? memory[b.i].number() : b.number();
+                        c = Value::Integer(x < y ? -1 : x > y ? 1 : 0);
+                        break;
+                    }
+
+                    case OpCode::EXP: c = Value::Float(std::exp(c.number())); break;
+                    case OpCode::ATAN: c = Value::Float(std::atan(c.number())); break;
+                    case OpCode::COS: c = Value::Float(std::cos(c.number())); break;
+                    case OpCode::LOG: c = Value::Float(std::log(c.number())); break;
+                    case OpCode::SIN: c = Value::Float(std::sin(c.number())); break;
+                    case OpCode::SQR: c = Value::Float(std::sqrt(c.number())); break;
+                    case OpCode::TAN: c = Value::Float(std::tan(c.number())); break;
+                    case OpCode::BNOT: c = Value::Integer(~(int32_t)c.number()); break;
+                    case OpCode::NOT: c = Value::Integer(c.number() == 0); break;
+                    case OpCode::BYT: c = Value::Byte((int32_t)c.number() & 0xFF); break;
+                    case OpCode::FLT: c = Value::Float(c.number()); break;
+                    case OpCode::INT: c = Value::Integer((int32_t)c.number()); break;
+                    case OpCode::RND:
+                        seed = seed * 1103515245 + 12345;
+                        c = Value::Float((seed >> 8) / 16777216.0f);
+                        break;
+                    case OpCode::SEED: seed = (uint32_t)c.number(); break;
+
+                    case OpCode::SETIDX: idx = address; break;
+                    case OpCode::MOVIDX: idx = frame + value.i; break;
+                    case OpCode::LOADIDX: idx = memory[address].i; break;
+                    case OpCode::INCIDX: idx += value.i; break;
+                    case OpCode::SAVEIDX: memory[address] = Value::Pointer(idx); break;
+                    case OpCode::PUSHIDX: stack.push_back(Value::Pointer(idx)); break;
+                    case OpCode::POPIDX: idx = pop(at).i; break;
+
+                    case OpCode::JMP: pc = target; break;
+                    case OpCode::JMPEZ: if (c.number() == 0) pc = target; break;
+                    case OpCode::JMPNZ: if (c.number() != 0) pc = target; break;
+                    case OpCode::JMPEQ: if (a.number() == b.number()) pc = target; break;
+                    case OpCode::JMPNE: if (a.number() != b.number()) pc = target; break;
+                    case OpCode::JMPLT: if (a.number() < b.number()) pc = target; break;
+                    case OpCode::JMPLE: if (a.number() <= b.number()) pc = target; break;
+                    case OpCode::JMPGT: if (a.number() > b.number()) pc = target; break;
+                    case OpCode::JMPGE: if (a.number() >= b.number()) pc = target; break;
+                    case OpCode::JMPIDX: {
+                        // A table of `arg' JMPs follows
+                        auto entry = (int32_t)c.number();
+                        if (entry < 0 || entry >= arg)
+                            fail(at, "Jump table index out of range");
+                        pc += entry * 3;
+                        break;
+                    }
+
+                    case OpCode::IDATA: memory[idx] = Value::Integer(arg); break;
+                    case OpCode::BDATA: memory[idx] = Value::Byte(arg); break;
+                    case OpCode::FDATA: memory[idx] = value; break;
+                    case OpCode::PDATA: memory[idx] = Value::Pointer(address); break;
+                    case OpCode::SDATA:
+                        for (size_t i = 0; i <= text.size(); i++)
+                            memory[idx + i] = Value::Byte(i < text.size() ? (uint8_t)text[i] : 0);
+                        break;
+
+                    case OpCode::SYSCALL: syscall((SysCall)call, log); break;
+                    case OpCode::YIELD: log << "YIELD" << std::endl; syscalls++; break;
+
+                    case OpCode::CALL:
+                        frames.push_back(std::make_pair(pc, frame));
+                        frame += 1024;
+                        pc = target;
+                        break;
+                    case OpCode::RETURN:
+                        if (frames.empty()) {
+                            pc = code.size();
+                        } else {
+                            pc = frames.back().first;
+                            frame = frames.back().second;
+                            frames.pop_back();
+                        }
+                        break;
+
+                    case OpCode::ALLOC: case OpCode::CALLOC:
+                        idx = heap;
+                        blocks[idx] = opcode == OpCode::ALLOC ? arg : (int32_t)c.number();
+                        heap += blocks[idx];
+                        break;
+                    case OpCode::FREEIDX: {
+                        auto block = blocks.find(idx);
+                        if (block == blocks.end())
+                            fail(at, "Free of unallocated block " + std::to_string(idx));
+
+                        // Anything still reading the block sees garbage
+                        for (int32_t i = 0; i < block->second; i++)
+                            memory[idx + i] = Value::Float(NAN);
+
+                        blocks.erase(block);
+                        break;
+                    }
+                    case OpCode::COPY:
+                        for (int32_t i = 0; i < (int32_t)c.number(); i++)
+                            memory[a.i + i] = memory[b.i + i];
+                        break;
+                    case OpCode::STRLEN: {
+                        int32_t length = 0;
+                        while (memory[idx + length].number() != 0)
+                            length++;
+                        c = Value::Integer(length);
+                        break;
+                    }
+                    case OpCode::STRCMP: {
+                        int32_t l = a.i, r = b.i, result = 0;
+
+                        for (;; l++, r++) {
+                            double x = memory[l].number(), y = memory[r].number();
+
+                            if (x != y) {
+                                result = x < y ? -1 : 1;
+                                break;
+                            }
+
+                            if (x == 0)
+                                break;
+                        }
+
+                        c = Value::Integer(result);
+                        break;
+                    }
+
+                    default:
+                        fail(at, "Unsupported opcode " + OpCodeAsString(opcode));
+                }
+            }
+        }
+};
+
+int main(int argc, char **argv) {
+    ez::ezOptionParser opt;
+
+    opt.overview = "soda step counter";
+    opt.syntax = std::string(argv[0]) + " [OPTIONS] file.obj\n";
+    opt.example = std::string(argv[0]) + " -n 300 a.obj\n";
+    opt.footer = std::string(argv[0]) + " v" + std::string(VERSION) + "\n";
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        0, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Display usage instructions.", // Help description.
+        "-h"     // Flag token.
+    );
+
+    opt.add(
+        "300", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "stop after ARG system calls", // Help description.
+        "-n"     // Flag token.
+    );
+
+    opt.add(
+        "200000000", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "stop after ARG instructions", // Help description.
+        "-m"     // Flag token.
+    );
+
+    opt.parse(argc, (const char**)argv);
+
+    if (opt.isSet("-h") || opt.lastArgs.empty()) {
+        std::string usage;
+        opt.getUsage(usage);
+        std::cout << usage << std::endl;
+        exit(1);
+    }
+
+    std::string filename = *opt.lastArgs[0];
+    std::ifstream infile(filename, std::ios::binary);
+
+    if (!infile.is_open()) {
+        std::cerr << "Could not open `" << filename << "'" << std::endl;
+        exit(-1);
+    }
+
+    std::vector<uint8_t> code((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+
+    // Skip the GR16 header
+    if (code.size() < 4) {
+        std::cerr << "`" << filename << "' is not an object file" << std::endl;
+        exit(-1);
+    }
+    code.erase(code.begin(), code.begin() + 4);
+
+    unsigned long maxSyscalls, maxSteps;
+    opt.get("-n")->getULong(maxSyscalls);
+    opt.get("-m")->getULong(maxSteps);
+
+    Machine machine(code);
+    machine.run(maxSyscalls, maxSteps, std::cout);
+
+    std::cerr << "steps " << machine.steps << " size " << machine.size() << " stack " << machine.stackDepth() << " blocks " << machine.liveBlocks() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+
+#include <iostream>
+
+#include "ezOptionParser.hpp"
+
+#include "Parser.h"
+#include "Compiler.h"
+#include "Flow.h"
+
+// Superinstruction miner. Compiles a corpus with -O, counts the opcode
+// sequences that occur inside basic blocks and proposes the most valuable
+// ones as fused opcodes, printing the System.h, System.cpp and Assembly.cpp
+// fragments needed to add them.
+
+typedef std::vector<OpCode> Sequence;
+
+struct Candidate {
+    Sequence sequence;
+    uint64_t count;
+
+    uint64_t saving() const {
+        return count * (sequence.size() - 1);
+    }
+};
+
+static std::map<std::string, uint64_t> readProfile(const std::string &filename) {
+    std::map<std::string, uint64_t> profile;
+    std::ifstream infile(filename);
+
+    if (!infile.is_open()) {
+        std::cerr << "Could not open `" << filename << "'" << std::endl;
+        exit(-1);
+    }
+
+    std::string label;
+    uint64_t count;
+
+    while (infile >> label >> count) {
+        profile[label] = count;
+    }
+
+    return profile;
+}
+
+// A jump can only end a sequence, since a fused opcode can only leave its
+// block at the end. Calls, returns and jump tables cannot be fused at all:
+// the CFG gives them edges of their own.
+static bool fusable(const Sequence &sequence) {
+    for (size_t i = 0; i < sequence.size(); i++) {
+        auto opcode = sequence[i];
+
+        if (opcode == OpCode::JMPIDX || opcode == OpCode::CALL || opcode == OpCode::RETURN || opcode == OpCode::HALT)
+            return false;
+
+        if (i+1 < sequence.size() && OpCodeIsJump(opcode))
+            return false;
+    }
+
+    return true;
+}
+
+// Blocks without a count of their own, such as the fall-through after a
+// conditional jump inside a loop, run as often as the block before them.
+static bool fallsThrough(const BasicBlock &block) {
+    auto opcode = block.terminator().opcode;
+    return opcode != OpCode::JMP && opcode != OpCode::RETURN && opcode != OpCode::HALT;
+}
+
+static void count(const ControlFlowGraph &cfg, const std::map<std::string, uint64_t> &profile, size_t longest, std::map<Sequence, uint64_t> &counts) {
+    uint64_t weight = 1;
+
+    for (size_t b = 0; b < cfg.size(); b++) {
+        const auto &block = cfg[b];
+
+        auto found = profile.find(block.label());
+        if (found != profile.end())
+            weight = found->second;
+        else if (!b || !fallsThrough(cfg[b-1]))
+            weight = 1;
+
+        Sequence opcodes;
+        for (const auto &token : block.asmTokens) {
+            if (token.opcode != OpCode::NOP)
+                opcodes.push_back(token.opcode);
+        }
+
+        for (size_t n = 2; n <= longest; n++) {
+            for (size_t i = 0; i+n <= opcodes.size(); i++) {
+                Sequence sequence(opcodes.begin()+i, opcodes.begin()+i+n);
+
+                if (fusable(sequence))
+                    counts[sequence] += weight;
+            }
+        }
+    }
+}
+
+static std::string name(const Sequence &sequence, const std::string &delim) {
+    std::string s;
+
+    for (size_t i = 0; i < sequence.size(); i++) {
+        if (i)
+            s += delim;
+        s += OpCodeAsString(sequence[i]);
+    }
+
+    return s;
+}
+
+static std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    std::replace(s.begin(), s.end(), '_', '-');
+    return s;
+}
+
+static std::string argTypeAsString(ArgType type) {
+    switch (type) {
+        case ArgType::NONE: return "NONE";
+        case ArgType::INT: return "INT";
+        case ArgType::VALUE: return "VALUE";
+        case ArgType::POINTER: return "POINTER";
+        case ArgType::FLOAT: return "FLOAT";
+        case ArgType::STRING: return "STRING";
+        case ArgType::LABEL: return "LABEL";
+        case ArgType::SYSCALL: return "SYSCALL";
+        default: return "NONE";
+    }
+}
+
+static std::string effectsAsString(uint32_t effects) {
+    const std::vector<std::pair<uint32_t, std::string>> names = {
+        {EFFECT_A, "EFFECT_A"}, {EFFECT_B, "EFFECT_B"}, {EFFECT_C, "EFFECT_C"}, {EFFECT_IDX, "EFFECT_IDX"},
+        {EFFECT_STACK, "EFFECT_STACK"}, {EFFECT_MEMORY, "EFFECT_MEMORY"}, {EFFECT_CONTROL, "EFFECT_CONTROL"}
+    };
+
+    if (effects == EFFECT_ALL)
+        return "EFFECT_ALL";
+
+    std::string s;
+
+    for (const auto &name : names) {
+        if (effects & name.first)
+            s += (s.size() ? "|" : "") + name.second;
+    }
+
+    return s.size() ? s : "EFFECT_NONE";
+}
+
+// A register written earlier in the sequence is not read from outside it.
+// The stack and memory are always counted as read.
+static uint32_t reads(const Sequence &sequence) {
+    const uint32_t registers = EFFECT_A|EFFECT_B|EFFECT_C|EFFECT_IDX;
+    uint32_t read = EFFECT_NONE, written = EFFECT_NONE;
+
+    for (auto opcode : sequence) {
+        read |= OpCodeReads(opcode) & ~(written & registers);
+        written |= OpCodeWrites(opcode);
+    }
+
+    return read;
+}
+
+static uint32_t writes(const Sequence &sequence) {
+    uint32_t written = EFFECT_NONE;
+
+    for (auto opcode : sequence)
+        written |= OpCodeWrites(opcode);
+
+    return written;
+}
+
+// The position of the one instruction in the sequence that carries an
+// argument, -1 when none do and -2 when more than one does.
+static int argumentAt(const Sequence &sequence) {
+    int at = -1;
+
+    for (size_t i = 0; i < sequence.size(); i++) {
+        if (OpCodeDefinition[OpCodeAsString(sequence[i])].second != ArgType::NONE) {
+            if (at != -1)
+                return -2;
+            at = i;
+        }
+    }
+
+    return at;
+}
+
+static void generate(const std::vector<Candidate> &candidates) {
+    std::cout << std::endl << "// System.h, before COUNT" << std::endl;
+    for (const auto &candidate : candidates) {
+        if (argumentAt(candidate.sequence) != -2)
+            std::cout << "    " << name(candidate.sequence, "_") << "," << std::endl;
+    }
+
+    std::cout << std::endl << "// System.cpp, OpCodeAsString()" << std::endl;
+    for (const auto &candidate : candidates) {
+        if (argumentAt(candidate.sequence) != -2) {
+            auto opcode = name(candidate.sequence, "_");
+            std::cout << "        case OpCode::" << opcode << ": return \"" << opcode << "\";" << std::endl;
+        }
+    }
+
+    std::cout << std::endl << "// System.cpp, OpCodeDefinition" << std::endl;
+    for (const auto &candidate : candidates) {
+        auto at = argumentAt(candidate.sequence);
+
+        if (at != -2) {
+            auto opcode = name(candidate.sequence, "_");
+            auto argtype = at == -1 ? ArgType::NONE : OpCodeDefinition[OpCodeAsString(candidate.sequence[at])].second;
+            std::cout << "    {\"" << opcode << "\", {OpCode::" << opcode << ", ArgType::" << argTypeAsString(argtype) << "}}," << std::endl;
+        }
+    }
+
+    // Without these the CFG would give a fused jump no edge to its target
+    auto jumps = std::count_if(candidates.begin(), candidates.end(), [](const Candidate &candidate) {
+        return argumentAt(candidate.sequence) != -2 && OpCodeIsJump(candidate.sequence.back());
+    });
+
+    if (jumps) {
+        std::cout << std::endl << "// System.cpp, OpCodeIsJump()" << std::endl;
+        for (const auto &candidate : candidates) {
+            if (argumentAt(candidate.sequence) != -2 && OpCodeIsJump(candidate.sequence.back()))
+                std::cout << "        case OpCode::" << name(candidate.sequence, "_") << ":" << std::endl;
+        }
+    }
+
+    std::cout << std::endl << "// System.cpp, OpCodeReads()" << std::endl;
+    for (const auto &candidate : candidates) {
+        if (argumentAt(candidate.sequence) != -2)
+            std::cout << "        case OpCode::" << name(candidate.sequence, "_") << ": return " << effectsAsString(reads(candidate.sequence)) << ";" << std::endl;
+    }
+
+    std::cout << std::endl << "// System.cpp, OpCodeWrites()" << std::endl;
+    for (const auto &candidate : candidates) {
+        if (argumentAt(candidate.sequence) != -2)
+            std::cout << "        case OpCode::" << name(candidate.sequence, "_") << ": return " << effectsAsString(writes(candidate.sequence)) << ";" << std::endl;
+    }
+
+    std::cout << std::endl << "// Assembly.cpp, PeepholeRules" << std::endl;
+    for (const auto &candidate : candidates) {
+        auto at = argumentAt(candidate.sequence);
+
+        if (at == -2)
+            continue;
+
+        auto opcode = name(candidate.sequence, "_");
+
+        std::cout << "    {" << std::endl;
+        std::cout << "        \"" << lower(opcode) << "\"," << std::endl;
+        std::cout << "        { { OpCode::" << name(candidate.sequence, " }, { OpCode::") << " } }," << std::endl;
+        std::cout << "        nullptr," << std::endl;
+        std::cout << "        [](const std::vector<AsmToken> &t, size_t i) {" << std::endl;
+        if (at == -1) {
+            std::cout << "            return std::vector<AsmToken>{ AsmToken(OpCode::" << opcode << ") };" << std::endl;
+        } else {
+            std::cout << "            auto token = t[i+" << at << "];" << std::endl;
+            std::cout << "            token.opcode = OpCode::" << opcode << ";" << std::endl;
+            std::cout << "            return std::vector<AsmToken>{ token };" << std::endl;
+        }
+        std::cout << "        }" << std::endl;
+        std::cout << "    }," << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    ez::ezOptionParser opt;
+
+    opt.overview = "soda superinstruction miner";
+    opt.syntax = std::string(argv[0]) + " [OPTIONS] file.soda...\n";
+    opt.example = std::string(argv[0]) + " -k 10 -p profile.txt examples/raycaster.soda\n";
+    opt.footer = std::string(argv[0]) + " v" + std::string(VERSION) + "\n";
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        0, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Display usage instructions.", // Help description.
+        "-h"     // Flag token.
+    );
+
+    opt.add(
+        "10", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Number of superinstructions to propose", // Help description.
+        "-k"     // Flag token.
+    );
+
+    opt.add(
+        "3", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Longest sequence to consider", // Help description.
+        "-n"     // Flag token.
+    );
+
+    opt.add(
+        "", // Default.
+        0, // Required?
+        1, // Number of args expected.
+        0, // Delimiter if expecting multiple args.
+        "Execution profile, one `label count' pair per line for the blocks starting at label", // Help description.
+        "-p"     // Flag token.
+    );
+
+    opt.parse(argc, (const char**)argv);
+
+    if (opt.isSet("-h") || opt.lastArgs.size() == 0) {
+        std::string usage;
+        opt.getUsage(usage);
+        std::cout << usage << std::endl;
+        exit(1);
+    }
+
+    int cpu = 16;
+    int k, longest;
+
+    opt.get("-k")->getInt(k);
+    opt.get("-n")->getInt(longest);
+
+    std::map<std::string, uint64_t> profile;
+
+    if (opt.isSet("-p")) {
+        std::string filename;
+        opt.get("-p")->getString(filename);
+        profile = readProfile(filename);
+    }
+
+    std::map<Sequence, uint64_t> counts;
+
+    for (const auto arg : opt.lastArgs) {
+        std::string filename = *arg;
+        std::ifstream infile(filename);
+
+        if (!infile.is_open()) {
+            std::cerr << "Could not open `" << filename << "'" << std::endl;
+            exit(-1);
+        }
+
+        std::stringstream buffer;
+        buffer << infile.rdbuf();
+
+        try {
+            std::map<std::string, int> hits;
+
+            FunctionLabels functions;
+            auto asmTokens = compile(cpu, parse(buffer.str()), true, 0, &functions);
+
+            asmTokens = optimise(cpu, asmTokens, hits, functions);
+
+            count(ControlFlowGraph(asmTokens), profile, longest, counts);
+        } catch (const std::exception &e) {
+            std::cerr << filename << ": " << e.what() << std::endl;
+        }
+    }
+
+    std::vector<Candidate> candidates;
+
+    for (const auto &entry : counts) {
+        candidates.push_back(Candidate{entry.first, entry.second});
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.saving() > b.saving();
+    });
+
+    // A sequence that only occurs inside a better candidate adds nothing
+    std::vector<Candidate> chosen;
+
+    for (const auto &candidate : candidates) {
+        if ((int)chosen.size() >= k)
+            break;
+
+        auto covered = std::any_of(chosen.begin(), chosen.end(), [&](const Candidate &better) {
+            return better.count == candidate.count && std::search(better.sequence.begin(), better.sequence.end(), candidate.sequence.begin(), candidate.sequence.end()) != better.sequence.end();
+        });
+
+        if (!covered)
+            chosen.push_back(candidate);
+    }
+
+    for (const auto &candidate : chosen) {
+        std::cout << "// " << candidate.saving() << " dispatches saved, " << candidate.count << "x " << name(candidate.sequence, " ");
+
+        if (argumentAt(candidate.sequence) == -2)
+            std::cout << " (more than one operand, fuse by hand)";
+
+        std::cout << std::endl;
+    }
+
+    generate(chosen);
+}